@@ -18,14 +18,18 @@
 
 #define __STDC_CONSTANT_MACROS 1
 
+#include <algorithm>
 #include <ctime>
 #include <climits>
-#include <queue>
+#include <memory>
+#include <new>
 #include <atomic>
+#include <vector>
 
 #include "access.h"
 #include "helper.h"
 #include "htsmessage.h"
+#include "htsschema.h"
 #include "sha1.h"
 
 #include <vlc_common.h>
@@ -41,30 +45,152 @@
 #define DEMUX_OK 1
 #define DEMUX_ERROR -1
 
+// Longest DemuxHTSP waits for a message, so that the input thread gets
+// to its controls on a quiet stream
+#define DEMUX_WAIT_TIMEOUT (CLOCK_FREQ / 10)
+
+// Stream indexes that can be disabled, tvheadend numbers the streams of a
+// service from 1 up. Streams above this are still filtered by the server but
+// not dropped locally
+#define MAX_STREAM_INDEX 256
+
+// A stream that has fallen this far behind the newest DTS has gone silent,
+// it no longer holds the PCR back until it sends again
+#define PCR_SILENT_TIME (3 * CLOCK_FREQ)
+
+struct hts_stream_type
+{
+    const char *name;
+    int cat;
+    vlc_fourcc_t codec;
+    bool ignoreTime;
+};
+
+static const hts_stream_type streamTypes[] =
+{
+    { "AC3",        AUDIO_ES, VLC_CODEC_A52,      false },
+    { "EAC3",       AUDIO_ES, VLC_CODEC_EAC3,     false },
+    { "MPEG2AUDIO", AUDIO_ES, VLC_CODEC_MPGA,     false },
+    { "AAC",        AUDIO_ES, VLC_CODEC_MP4A,     false },
+    { "VORBIS",     AUDIO_ES, VLC_CODEC_VORBIS,   false },
+    { "MPEG2VIDEO", VIDEO_ES, VLC_CODEC_MP2V,     false },
+    { "H264",       VIDEO_ES, VLC_CODEC_H264,     false },
+    { "DVBSUB",     SPU_ES,   VLC_CODEC_DVBS,     true  },
+    { "TEXTSUB",    SPU_ES,   VLC_CODEC_TEXT,     true  },
+    { "TELETEXT",   SPU_ES,   VLC_CODEC_TELETEXT, true  },
+};
+
+static const hts_stream_type *FindStreamType(const HtsStrView &type)
+{
+    for(size_t i = 0; i < sizeof(streamTypes) / sizeof(streamTypes[0]); i++)
+        if(type == streamTypes[i].name)
+            return &streamTypes[i];
+    return 0;
+}
+
+// Owned by the demux thread
 struct hts_stream
 {
     hts_stream()
         :index(0)
         ,es(0)
-        ,lastDts(0)
-        ,lastPts(0)
-        ,ignoreTime(false)
     {}
 
     uint32_t index;
+    std::string type;
     es_out_id_t *es;
     es_format_t fmt;
-    mtime_t lastDts;
-    mtime_t lastPts;
+};
+
+// Owned by the reading thread, which builds the blocks
+struct hts_track
+{
+    hts_track()
+        :index(0)
+        ,active(false)
+        ,video(false)
+        ,ignoreTime(false)
+        ,silent(false)
+        ,lastDts(0)
+    {}
+
+    uint32_t index;
+    // Has an ES, packets of other streams are dropped
+    bool active;
+    bool video;
     bool ignoreTime;
+    // Left out of the PCR until its next packet
+    bool silent;
+    mtime_t lastDts;
+};
+
+/* What the reading thread hands to DemuxHTSP: either a block built from a
+ * muxpkt, for the stream at the same position in the subscriptionStart,
+ * or any other message. An empty item ends the stream. */
+struct demux_item_t
+{
+    demux_item_t()
+        :block(0)
+        ,stream(0)
+        ,pcr(0)
+    {}
+
+    demux_item_t(demux_item_t &&other)
+        :msg(std::move(other.msg))
+        ,block(other.block)
+        ,stream(other.stream)
+        ,pcr(other.pcr)
+    {
+        other.block = 0;
+    }
+
+    demux_item_t &operator=(demux_item_t &&other)
+    {
+        if(this != &other)
+        {
+            if(block)
+                block_Release(block);
+            msg = std::move(other.msg);
+            block = other.block;
+            stream = other.stream;
+            pcr = other.pcr;
+            other.block = 0;
+        }
+        return *this;
+    }
+
+    ~demux_item_t()
+    {
+        if(block)
+            block_Release(block);
+    }
+
+    uint32_t getLength() const { return block ? block->i_buffer : msg.getLength(); }
+
+    HtsMessage msg;
+    block_t *block;
+    uint32_t stream;
+    // Set before the block is sent, 0 for none
+    mtime_t pcr;
+
+    private:
+    demux_item_t(const demux_item_t &);
+    demux_item_t &operator=(const demux_item_t &);
 };
 
 struct demux_sys_t : public sys_common_t
 {
     demux_sys_t()
         :lastPcr(0)
-        ,ptsDelay(300000)
+        ,pcrInterval(100000)
         ,currentPcr(0)
+        ,pcrMin(0)
+        ,pcrTrack(-1)
+        ,pcrNext(0)
+        ,maxDts(0)
+        ,pcrSent(0)
+        ,pcrScans(0)
+        ,pcrSilenced(0)
         ,tsOffset(0)
         ,tsStart(0)
         ,tsEnd(0)
@@ -77,17 +203,30 @@ struct demux_sys_t : public sys_common_t
         ,username("")
         ,password("")
         ,channelId(0)
+        ,subscriptionId(0)
+        ,subscribed(false)
+        ,resumed(false)
         ,hadIFrame(false)
+        ,openTime(0)
+        ,hadFirstFrame(false)
         ,drops(0)
         ,epg(0)
         ,thread(0)
+        ,aborted(false)
+        ,throttled(false)
+        ,throttles(0)
+        ,throttledTime(0)
         ,requestSpeed(INT_MIN)
         ,requestSeek(-1)
+        ,requestTime(0)
+        ,batchMessages(1)
+        ,batchTime(0)
         ,doDisable(false)
     {
-        vlc_mutex_init(&queueMutex);
-        vlc_cond_init(&queueCond);
-        vlc_mutex_init(&disableMutex);
+        readTimeout = READ_TIMEOUT;
+
+        for(uint32_t i = 0; i < MAX_STREAM_INDEX / 64; i++)
+            disabled[i] = 0;
     }
 
     ~demux_sys_t()
@@ -97,26 +236,39 @@ struct demux_sys_t : public sys_common_t
 
         vlc_UrlClean(&url);
 
-        vlc_mutex_destroy(&queueMutex);
-        vlc_cond_destroy(&queueCond);
-        vlc_mutex_destroy(&disableMutex);
-
         if(epg)
             vlc_epg_Delete(epg);
     }
 
     mtime_t lastPcr;
-    mtime_t ptsDelay;
-    mtime_t currentPcr;
+    mtime_t pcrInterval;
+    std::atomic<mtime_t> currentPcr;
+
+    // Lowest DTS of the timed streams that are not silent, and the track
+    // it comes from. Kept by the reading thread as packets arrive, it is
+    // only searched for again when that track moves past pcrNext, which
+    // stays at or below the DTS of all other streams (0 for none)
+    mtime_t pcrMin;
+    int pcrTrack;
+    mtime_t pcrNext;
+    mtime_t maxDts;
+    uint32_t pcrSent;
+    uint32_t pcrScans;
+    uint32_t pcrSilenced;
+    // How far the PCR sent trails the newest DTS
+    Histogram pcrLag;
 
     std::atomic<mtime_t> tsOffset;
     std::atomic<mtime_t> tsStart;
     std::atomic<mtime_t> tsEnd;
 
-    uint32_t timeshiftPeriod;
+    std::atomic<uint32_t> timeshiftPeriod;
 
     uint32_t streamCount;
     hts_stream *stream;
+    std::vector<hts_track> tracks;
+    // Position in tracks by stream index, -1 for none
+    std::vector<int> trackByIndex;
 
     bool audioOnly;
 
@@ -127,38 +279,75 @@ struct demux_sys_t : public sys_common_t
     std::string username;
     std::string password;
     int channelId;
+    std::atomic<uint32_t> subscriptionId;
 
-    std::string serverName;
-    std::string serverVersion;
-    int32_t protoVersion;
+    // Set once a subscription went through, only then a lost connection is
+    // reconnected to
+    bool subscribed;
+    // The next subscriptionStart is for a resumed subscription
+    std::atomic<bool> resumed;
 
     bool hadIFrame;
 
+    // Time to first frame
+    mtime_t openTime;
+    bool hadFirstFrame;
+
     uint32_t drops;
 
-    vlc_epg_t *epg;
+    // Filled by the reading thread with fast open
+    std::atomic<vlc_epg_t*> epg;
 
-    vlc_mutex_t queueMutex;
-    vlc_cond_t queueCond;
     vlc_thread_t thread;
-    std::queue<HtsMessage> msgQueue;
+    // Filled by the reading thread only, emptied by DemuxHTSP only
+    MessageRing<demux_item_t> msgQueue;
+    // Set once the stream ended on the reading thread. The end of stream
+    // item that goes with it may not have fit in the ring.
+    std::atomic<bool> aborted;
+    // The reading thread waits for the demuxer to catch up
+    std::atomic<bool> throttled;
+    uint32_t throttles;
+    mtime_t throttledTime;
     std::atomic<int> requestSpeed;
     std::atomic<int64_t> requestSeek;
 
-    std::atomic<bool> doDisable;
-    vlc_mutex_t disableMutex;
+    // When the oldest control request not sent yet was made
+    std::atomic<mtime_t> requestTime;
+    Histogram requestLatency;
+
+    // Most messages and time handled per DemuxHTSP call
+    uint32_t batchMessages;
+    mtime_t batchTime;
+    Histogram batchSizes;
+
+    // Streams to filter out, set by TrackStreams() and sent by
+    // SendControlRequests(), both on the reading thread
+    bool doDisable;
     std::list<int64_t> disables;
+    // The same streams as disables, a bit per stream index. Written by the
+    // reading thread, read by both threads without a lock
+    std::atomic<uint64_t> disabled[MAX_STREAM_INDEX / 64];
+};
+
+struct hts_block_t
+{
+    block_t block;
+    HtsBuffer buffer;
 };
 
 int SpeedHTSP(demux_t *demux, int state);
 int SeekHTSP(demux_t *demux, int64_t time, bool precise);
 void * RunHTSP(void *obj);
 
+static void TrackStreams(demux_t *demux, HtsMessage &msg);
+static void TrackSkip(demux_t *demux, HtsMessage &msg);
+static bool BuildBlock(demux_t *demux, HtsMessage &msg, demux_item_t *item);
+
 /***************************************************
  ****       Initialization Functions            ****
  ***************************************************/
 
-bool ConnectHTSP(demux_t *demux)
+static bool OpenConnection(demux_t *demux)
 {
     demux_sys_t *sys = demux->p_sys;
 
@@ -170,25 +359,25 @@ bool ConnectHTSP(demux_t *demux)
         return false;
     }
 
-    HtsMap map;
-    map.setData("method", "hello");
-    map.setData("clientname", "VLC media player");
-    map.setData("htspversion", HTSP_PROTO_VERSION);
+    msg_Dbg(demux, "Connected %lld ms after open", (long long int)(mdate() - sys->openTime) / 1000);
 
-    HtsMessage m = ReadResult(demux, sys, map.makeMsg());
-    if(!m.isValid())
-    {
-        msg_Err(demux, "ReadResult failed!");
-        return false;
-    }
+    return true;
+}
 
-    uint32_t chall_len;
-    void * chall;
+static void BuildHello(HtsMessageBuilder &hello)
+{
+    hello.setData(HtsKeys::method, "hello");
+    hello.setData(HtsKeys::clientname, "VLC media player");
+    hello.setData(HtsKeys::htspversion, HTSP_PROTO_VERSION);
+}
+
+static void ParseHello(demux_t *demux, HtsMessage &m)
+{
+    demux_sys_t *sys = demux->p_sys;
 
-    sys->serverName = m.getRoot()->getStr("servername");
-    sys->serverVersion = m.getRoot()->getStr("serverversion");
-    sys->protoVersion = m.getRoot()->getU32("htspversion");
-    m.getRoot()->getBin("challenge", &chall_len, &chall);
+    sys->serverName = m.getRoot()->getStr(HtsKeys::servername);
+    sys->serverVersion = m.getRoot()->getStr(HtsKeys::serverversion);
+    sys->protoVersion = m.getRoot()->getU32(HtsKeys::htspversion);
 
     msg_Info(demux, "Connected to HTSP Server %s, version %s, protocol %d", sys->serverName.c_str(), sys->serverVersion.c_str(), sys->protoVersion);
     if(sys->protoVersion < HTSP_PROTO_VERSION)
@@ -199,15 +388,20 @@ bool ConnectHTSP(demux_t *demux)
     {
         msg_Info(demux, "TVHeadend is running a more recent version of HTSP(v%d) than we are(v%d). Check if there is an update available!", sys->protoVersion, HTSP_PROTO_VERSION);
     }
+}
 
-    if(sys->username.empty())
-        return true;
+// The digest can only be computed with the challenge from the hello reply
+static void BuildAuth(demux_t *demux, HtsMessageBuilder &auth, HtsMessage *hello)
+{
+    demux_sys_t *sys = demux->p_sys;
 
-    msg_Info(demux, "Starting authentication...");
+    auth.setData(HtsKeys::method, "authenticate");
+    auth.setData(HtsKeys::username, sys->username);
 
-    map = HtsMap();
-    map.setData("method", "authenticate");
-    map.setData("username", sys->username);
+    uint32_t chall_len = 0;
+    const void *chall = 0;
+    if(hello)
+        hello->getRoot()->getBinView(HtsKeys::challenge, &chall_len, &chall);
 
     if(sys->password != "" && chall)
     {
@@ -220,21 +414,44 @@ bool ConnectHTSP(demux_t *demux)
         hts_sha1_update(shactx, (const uint8_t *)chall, chall_len);
         hts_sha1_final(shactx, d);
 
-        std::shared_ptr<HtsBin> bin = std::make_shared<HtsBin>();
-        bin->setBin(20, d);
-        map.setData("digest", bin);
+        auth.setData(HtsKeys::digest, d, 20);
 
         free(shactx);
     }
     else
         msg_Info(demux, "Authenticating as '%s' without a password", sys->username.c_str());
+}
+
+bool ConnectHTSP(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
 
-    if(chall)
-        free(chall);
+    if(!OpenConnection(demux))
+        return false;
+
+    HtsMessageBuilder hello(sys->txBuffer);
+    BuildHello(hello);
+
+    HtsMessage m = ReadResult(demux, sys, hello);
+    if(!m.isValid())
+    {
+        msg_Err(demux, "ReadResult failed!");
+        return false;
+    }
+
+    ParseHello(demux, m);
+
+    if(sys->username.empty())
+        return true;
+
+    msg_Info(demux, "Starting authentication...");
+
+    HtsMessageBuilder auth(sys->txBuffer);
+    BuildAuth(demux, auth, &m);
 
     msg_Info(demux, "Sending authentication...");
 
-    bool res = ReadSuccess(demux, sys, map.makeMsg(), "auth");
+    bool res = ReadSuccess(demux, sys, auth, "auth");
     if(res)
         msg_Info(demux, "Successfully authenticated!");
     else
@@ -243,58 +460,65 @@ bool ConnectHTSP(demux_t *demux)
     return res;
 }
 
-void PopulateEPG(demux_t *demux)
+static void AddEvent(demux_sys_t *sys, vlc_epg_t *epg, HtsMap &event, int64_t now)
 {
-    demux_sys_t *sys = demux->p_sys;
+    if(event.getU32(HtsKeys::channelId) != (uint32_t)sys->channelId)
+        return;
 
-    HtsMap map;
-    map.setData("method", "getEvents");
-    map.setData("channelId", sys->channelId);
+    int64_t start = event.getS64(HtsKeys::start);
+    int64_t stop = event.getS64(HtsKeys::stop);
+    int duration = stop - start;
 
-    HtsMessage res = ReadResult(demux, sys, map.makeMsg());
-    if(!res.isValid())
-        return;
+#if CHECK_VLC_VERSION(2,1)
+    vlc_epg_AddEvent(epg, start, duration, event.getStr(HtsKeys::title).c_str(), event.getStr(HtsKeys::summary).c_str(), event.getStr(HtsKeys::description).c_str(), 0);
+#else
+    vlc_epg_AddEvent(epg, start, duration, event.getStr(HtsKeys::title).c_str(), event.getStr(HtsKeys::summary).c_str(), event.getStr(HtsKeys::description).c_str());
+#endif
 
-    sys->epg = vlc_epg_New(0);
+    if(now >= start && now < stop)
+        vlc_epg_SetCurrent(epg, start);
+}
 
-    std::shared_ptr<HtsList> events = res.getRoot()->getList("events");
-    for(uint32_t i = 0; i < events->count(); i++)
-    {
-        std::shared_ptr<HtsData> tmp = events->getData(i);
-        if(!tmp->isMap())
-            continue;
-        std::shared_ptr<HtsMap> event = std::static_pointer_cast<HtsMap>(tmp);
+void PopulateEPG(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
 
-        if(event->getU32("channelId") != (uint32_t)sys->channelId)
-            continue;
+    HtsMessageBuilder req(sys->txBuffer);
+    req.setData(HtsKeys::method, "getEvents");
+    req.setData(HtsKeys::channelId, sys->channelId);
 
-        int64_t start = event->getS64("start");
-        int64_t stop = event->getS64("stop");
-        int duration = stop - start;
+    // Events are added as they come in, the reply is never held as a whole
+    vlc_epg_t *epg = vlc_epg_New(0);
+    int64_t now = time(0);
 
-#if CHECK_VLC_VERSION(2,1)
-        vlc_epg_AddEvent(sys->epg, start, duration, event->getStr("title").c_str(), event->getStr("summary").c_str(), event->getStr("description").c_str(), 0);
-#else
-        vlc_epg_AddEvent(sys->epg, start, duration, event->getStr("title").c_str(), event->getStr("summary").c_str(), event->getStr("description").c_str());
-#endif
+    HtsStreamParser events(HtsKeys::events, [&](HtsMap &event) {
+        AddEvent(sys, epg, event, now);
+    }, sys->arenas);
 
-        int64_t now = time(0);
-        if(now >= start && now < stop)
-            vlc_epg_SetCurrent(sys->epg, start);
+    HtsMessage res = ReadResultStreamed(demux, sys, req, &events);
+    if(!res.isValid())
+    {
+        vlc_epg_Delete(epg);
+        return;
     }
+
+    sys->epg = epg;
 }
 
-bool SubscribeHTSP(demux_t *demux)
+static void BuildSubscribe(demux_t *demux, HtsMessageBuilder &req)
 {
     demux_sys_t *sys = demux->p_sys;
 
-    HtsMap map;
-    map.setData("method", "subscribe");
-    map.setData("channelId", sys->channelId);
-    map.setData("subscriptionId", 1);
-    map.setData("queueDepth", 5*1024*1024);
-    map.setData("timeshiftPeriod", (uint32_t)~0);
-    map.setData("normts", 1);
+    // Ids keep counting up on a session, so that whatever is still in flight
+    // for an earlier owner is never taken for ours
+    sys->subscriptionId = sys->nextSubscriptionId++;
+
+    req.setData(HtsKeys::method, "subscribe");
+    req.setData(HtsKeys::channelId, sys->channelId);
+    req.setData(HtsKeys::subscriptionId, (uint32_t)sys->subscriptionId);
+    req.setData(HtsKeys::queueDepth, 5*1024*1024);
+    req.setData(HtsKeys::timeshiftPeriod, (uint32_t)~0);
+    req.setData(HtsKeys::normts, 1);
 
     if(var_InheritBool(demux, CFG_PREFIX"useprofile"))
     {
@@ -302,7 +526,7 @@ bool SubscribeHTSP(demux_t *demux)
 
         s = var_InheritString(demux, CFG_PREFIX"profile");
         if(s && *s)
-            map.setData("profile", s);
+            req.setData(HtsKeys::profile, s);
         if(s)
             free(s);
     }
@@ -314,52 +538,209 @@ bool SubscribeHTSP(demux_t *demux)
 
         s = var_InheritString(demux, CFG_PREFIX"vcodec");
         if(s && *s)
-            map.setData("videoCodec", s);
+            req.setData(HtsKeys::videoCodec, s);
         if(s)
             free(s);
 
         s = var_InheritString(demux, CFG_PREFIX"acodec");
         if(s && *s)
-            map.setData("audioCodec", s);
+            req.setData(HtsKeys::audioCodec, s);
         if(s)
             free(s);
 
         s = var_InheritString(demux, CFG_PREFIX"scodec");
         if(s && *s)
-            map.setData("subtitleCodec", s);
+            req.setData(HtsKeys::subtitleCodec, s);
         if(s)
             free(s);
 
         s = var_InheritString(demux, CFG_PREFIX"tlanguage");
         if(s && *s)
-            map.setData("language", s);
+            req.setData(HtsKeys::language, s);
         if(s)
             free(s);
 
         i = var_InheritInteger(demux, CFG_PREFIX"tresolution");
         if(i)
-            map.setData("maxResolution", i);
+            req.setData(HtsKeys::maxResolution, i);
 
         i = var_InheritInteger(demux, CFG_PREFIX"tchannels");
         if(i)
-            map.setData("channels", i);
+            req.setData(HtsKeys::channels, i);
 
         i = var_InheritInteger(demux, CFG_PREFIX"tbandwidth");
         if(i)
-            map.setData("bandwidth", i);
+            req.setData(HtsKeys::bandwidth, i);
     }
+}
 
-    HtsMessage res = ReadResult(demux, sys, map.makeMsg());
-    if(!res.isValid())
-        return false;
+static void ParseSubscribeReply(demux_t *demux, HtsMessage &res)
+{
+    demux_sys_t *sys = demux->p_sys;
 
-    sys->timeshiftPeriod = res.getRoot()->getU32("timeshiftPeriod");
+    sys->timeshiftPeriod = res.getRoot()->getU32(HtsKeys::timeshiftPeriod);
+    sys->subscribed = true;
 
     msg_Info(demux, "Successfully subscribed to channel %d", sys->channelId);
+    msg_Dbg(demux, "Subscribed %lld ms after open", (long long int)(mdate() - sys->openTime) / 1000);
+}
+
+bool SubscribeHTSP(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    HtsMessageBuilder req(sys->txBuffer);
+    BuildSubscribe(demux, req);
+
+    HtsMessage res = ReadResult(demux, sys, req);
+    if(!res.isValid())
+        return false;
+
+    ParseSubscribeReply(demux, res);
 
     return true;
 }
 
+/* Fast open: the requests go out without waiting for each other and the
+ * replies are handled on the reading thread, Open returns as soon as the
+ * connection is up. Failures end the stream instead of failing Open. */
+
+static void AbortHTSP(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    // Several failing replies may end the stream, it only ends once
+    if(sys->aborted.exchange(true))
+        return;
+
+    // With the ring full DemuxHTSP sees the flag once it drained it
+    if(!sys->msgQueue.push(demux_item_t()))
+        msg_Dbg(demux, "Message ring full, end of stream deferred");
+}
+
+static void RequestEPG(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    HtsMessageBuilder req(sys->txBuffer);
+    req.setData(HtsKeys::method, "getEvents");
+    req.setData(HtsKeys::channelId, sys->channelId);
+
+    // As with PopulateEPG events are added as they come in. The guide is
+    // only handed to the demux thread, by UpdateEPG(), once it is complete.
+    vlc_epg_t *epg = vlc_epg_New(0);
+    int64_t now = time(0);
+
+    std::shared_ptr<HtsStreamParser> events = std::make_shared<HtsStreamParser>(HtsKeys::events, [=](HtsMap &event) {
+        AddEvent(demux->p_sys, epg, event, now);
+    }, sys->arenas);
+
+    reply_callback_t done = [demux, epg, events](HtsMessage &reply) {
+        if(!reply.isValid())
+        {
+            vlc_epg_Delete(epg);
+            return;
+        }
+
+        vlc_epg_t *old = demux->p_sys->epg.exchange(epg);
+        if(old)
+            vlc_epg_Delete(old);
+    };
+
+    uint32_t seq = SendRequestAsyncStreamed(demux, sys, req, done, events.get());
+
+    if(seq == 0)
+        vlc_epg_Delete(epg);
+}
+
+static void SendSubscribe(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    HtsMessageBuilder req(sys->txBuffer);
+    BuildSubscribe(demux, req);
+
+    SendRequestAsync(demux, sys, req, [demux](HtsMessage &reply) {
+        if(!reply.isValid())
+        {
+            msg_Err(demux, "Subscribing to channel failed");
+            AbortHTSP(demux);
+            return;
+        }
+
+        ParseSubscribeReply(demux, reply);
+        RequestEPG(demux);
+    });
+}
+
+static void SendAuth(demux_t *demux, HtsMessage *hello)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    HtsMessageBuilder auth(sys->txBuffer);
+    BuildAuth(demux, auth, hello);
+
+    SendRequestAsync(demux, sys, auth, [demux](HtsMessage &reply) {
+        if(reply.isValid())
+            msg_Info(demux, "Successfully authenticated!");
+        else
+        {
+            msg_Err(demux, "Authentication failed!");
+            AbortHTSP(demux);
+        }
+    });
+}
+
+bool StartHTSP(demux_t *demux, bool reused)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    if(reused)
+    {
+        SendSubscribe(demux);
+        return sys->netfd >= 0;
+    }
+
+    if(!OpenConnection(demux))
+        return false;
+
+    // Only a password digest has to wait for the challenge
+    bool needChallenge = !sys->username.empty() && !sys->password.empty();
+
+    CorkTransmit(sys);
+
+    HtsMessageBuilder hello(sys->txBuffer);
+    BuildHello(hello);
+
+    SendRequestAsync(demux, sys, hello, [=](HtsMessage &reply) {
+        demux_sys_t *sys = demux->p_sys;
+        if(!reply.isValid())
+        {
+            msg_Err(demux, "No valid hello response");
+            AbortHTSP(demux);
+            return;
+        }
+
+        ParseHello(demux, reply);
+        if(!needChallenge)
+            return;
+
+        CorkTransmit(sys);
+        SendAuth(demux, &reply);
+        SendSubscribe(demux);
+        UncorkTransmit(demux, sys);
+    });
+
+    if(!needChallenge)
+    {
+        if(!sys->username.empty())
+            SendAuth(demux, 0);
+        SendSubscribe(demux);
+    }
+
+    return UncorkTransmit(demux, sys);
+}
+
 bool parseURL(demux_t *demux)
 {
     demux_sys_t *sys = demux->p_sys;
@@ -394,6 +775,13 @@ bool parseURL(demux_t *demux)
     return true;
 }
 
+// Options given with the MRL or on the command line are not checked against
+// the range of the setting
+static int64_t InheritRange(demux_t *demux, const char *name, int64_t min, int64_t max)
+{
+    return std::min(max, std::max(min, var_InheritInteger(demux, name)));
+}
+
 int OpenHTSP(vlc_object_t *obj)
 {
     demux_t *demux = (demux_t*)obj;
@@ -402,12 +790,25 @@ int OpenHTSP(vlc_object_t *obj)
     if(unlikely(sys == NULL))
         return VLC_ENOMEM;
     demux->p_sys = sys;
+    sys->openTime = mdate();
 
     demux->pf_demux = DemuxHTSP;
     demux->pf_control = ControlHTSP;
 
     sys->audioOnly = var_InheritBool(demux, CFG_PREFIX"audio-only");
 
+    uint32_t queueMessages = InheritRange(demux, CFG_PREFIX"queue-messages", QUEUE_MESSAGES_MIN, QUEUE_MESSAGES_MAX);
+    uint64_t queueBytes = InheritRange(demux, CFG_PREFIX"queue-size", QUEUE_SIZE_MIN, QUEUE_SIZE_MAX) * 1024;
+    sys->queue.setBudget(queueMessages, queueBytes);
+    sys->batchMessages = InheritRange(demux, CFG_PREFIX"demux-batch", 1, DEMUX_BATCH_MAX);
+    sys->batchTime = InheritRange(demux, CFG_PREFIX"demux-batch-time", 0, DEMUX_BATCH_TIME_MAX);
+    sys->pcrInterval = InheritRange(demux, CFG_PREFIX"pcr-interval", 0, PCR_INTERVAL_MAX);
+
+    sys->msgQueue.open(queueMessages, queueBytes);
+
+    if(!OpenWakeup(sys))
+        msg_Warn(demux, "No reader wakeup, control requests wait for the next message");
+
     msg_Info(demux, "HTSP plugin loading...");
 
     if(!parseURL(demux))
@@ -417,26 +818,41 @@ int OpenHTSP(vlc_object_t *obj)
         return VLC_EGENERIC;
     }
 
-    if(!ConnectHTSP(demux))
+    if(sys->channelId == 0)
     {
-        msg_Dbg(demux, "Connecting to HTS source failed!");
+        msg_Err(demux, "HTSP ChannelID 0 is invalid!");
         CloseHTSP(obj);
         return VLC_EGENERIC;
     }
 
-    if(sys->channelId == 0)
+    bool reused = AcquireSession(demux, sys, sys->host, sys->port, sys->username, sys->password);
+
+    if(var_InheritBool(demux, CFG_PREFIX"fast-open"))
     {
-        msg_Err(demux, "HTSP ChannelID 0 is invalid!");
-        return VLC_EGENERIC;
+        if(!StartHTSP(demux, reused))
+        {
+            msg_Dbg(demux, "Connecting to HTS source failed!");
+            CloseHTSP(obj);
+            return VLC_EGENERIC;
+        }
     }
+    else
+    {
+        if(!reused && !ConnectHTSP(demux))
+        {
+            msg_Dbg(demux, "Connecting to HTS source failed!");
+            CloseHTSP(obj);
+            return VLC_EGENERIC;
+        }
 
-    PopulateEPG(demux);
+        PopulateEPG(demux);
 
-    if(!SubscribeHTSP(demux))
-    {
-        msg_Dbg(demux, "Subscribing to channel failed");
-        CloseHTSP(obj);
-        return VLC_EGENERIC;
+        if(!SubscribeHTSP(demux))
+        {
+            msg_Dbg(demux, "Subscribing to channel failed");
+            CloseHTSP(obj);
+            return VLC_EGENERIC;
+        }
     }
 
     if(vlc_clone(&sys->thread, RunHTSP, demux, VLC_THREAD_PRIORITY_INPUT))
@@ -463,6 +879,32 @@ void CloseHTSP(vlc_object_t *obj)
         sys->thread = 0;
     }
 
+    if(sys->netfd >= 0 && sys->subscriptionId != 0)
+    {
+        HtsMessageBuilder req(sys->txBuffer);
+        req.setData(HtsKeys::method, "unsubscribe");
+        req.setData(HtsKeys::subscriptionId, (uint32_t)sys->subscriptionId);
+
+        // Packets sent before the server got this would otherwise be read
+        // by the next owner of the session
+        uint32_t seq = SendRequest(demux, sys, req);
+        if(seq != 0)
+            DrainToReply(demux, sys, seq);
+    }
+
+    ReleaseSession(demux, sys, sys->host, sys->port, sys->username, sys->password);
+
+    sys->requestLatency.dump(obj, "Control request latency");
+    sys->batchSizes.dump(obj, "Demux batch size", "messages");
+    sys->pcrLag.dump(obj, "PCR lag");
+    msg_Dbg(demux, "PCR sent %u times, %u stream scans, %u streams gone silent", sys->pcrSent, sys->pcrScans, sys->pcrSilenced);
+    sys->msgQueue.dump(obj, "Demux queue");
+    sys->queue.dump(obj, "Reply queue");
+    msg_Dbg(demux, "Reads paused %u times for %lld ms", sys->throttles, (long long int)sys->throttledTime / 1000);
+
+    msg_Dbg(demux, "Message arenas: %u created, %u reused, %llu heap allocations",
+        sys->arenas->getCreated(), sys->arenas->getReused(), (unsigned long long)HtsArena::getHeapAllocations());
+
     delete sys;
     sys = demux->p_sys = 0;
 }
@@ -546,100 +988,271 @@ void ParseTimeshiftStatus(demux_t *demux, HtsMessage &msg)
 {
     demux_sys_t *sys = demux->p_sys;
 
-    sys->tsOffset = msg.getRoot()->getS64("shift");
-    sys->tsStart = msg.getRoot()->getS64("start");
-    sys->tsEnd = msg.getRoot()->getS64("end");
+    HtsTimeshiftStatus status;
+    HtsDecode(msg, status);
+
+    sys->tsOffset = status.shift;
+    sys->tsStart = status.start;
+    sys->tsEnd = status.end;
 }
 
-void * RunHTSP(void *obj)
+static reply_callback_t LogFailure(demux_t *demux, const char *action)
 {
-    demux_t *demux = (demux_t*)obj;
-    demux_sys_t *sys = demux->p_sys;
-    std::list<int64_t> oldDisable;
+    return [demux, action](HtsMessage &reply) {
+        if(!reply.isValid())
+            msg_Err(demux, "Failed to %s", action);
+    };
+}
 
-    for(;;)
+static void CancelReconnect(void *data)
+{
+    demux_sys_t *sys = (demux_sys_t*)data;
+
+    // Half way through the handshake, the connection can't be handed on
+    if(sys->netfd >= 0)
     {
-        HtsMessage msg = ReadMessage(demux, sys);
-        if(!msg.isValid())
-        {
-            vlc_mutex_lock(&sys->queueMutex);
-            sys->msgQueue.push(HtsMessage());
-            vlc_cond_signal(&sys->queueCond);
-            vlc_mutex_unlock(&sys->queueMutex);
-            return 0;
-        }
+        net_Close(sys->netfd);
+        sys->netfd = -1;
+    }
+}
 
-        std::string method = msg.getRoot()->getStr("method");
-        uint32_t subs = msg.getRoot()->getU32("subscriptionId");
+// Connects and subscribes again after the connection was lost, with the
+// same options as before. The ES are kept if the streams are the same, and
+// a timeshifted subscription is sought back to where playback was.
+static bool ReconnectHTSP(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
 
-        if(method == "timeshiftStatus" && subs == 1)
-        {
-            ParseTimeshiftStatus(demux, msg);
-        }
-        else
-        {
-            vlc_mutex_lock(&sys->queueMutex);
-            sys->msgQueue.push(msg);
-            vlc_cond_signal(&sys->queueCond);
-            vlc_mutex_unlock(&sys->queueMutex);
-        }
+    mtime_t resumeTime = sys->tsOffset != 0 ? (mtime_t)sys->currentPcr : 0;
+    int delay = RECONNECT_DELAY_MIN;
 
-        if(sys->requestSpeed != INT_MIN)
-        {
-            HtsMap map;
-            map.setData("method", "subscriptionSpeed");
-            map.setData("subscriptionId", 1);
-            map.setData("speed", (int)sys->requestSpeed);
+    for(int attempt = 1; attempt <= RECONNECT_ATTEMPTS; attempt++)
+    {
+        msg_Warn(demux, "Connection lost, reconnecting in %d s (attempt %d of %d)", delay, attempt, RECONNECT_ATTEMPTS);
+        msleep(delay * CLOCK_FREQ);
 
-            ReadSuccess(demux, sys, map.makeMsg(), "set speed");
+        sys->resumed = true;
 
-            sys->requestSpeed = INT_MIN;
-        }
+        bool res;
+        vlc_cleanup_push(CancelReconnect, sys);
+        res = ConnectHTSP(demux) && SubscribeHTSP(demux);
+        vlc_cleanup_pop();
 
-        if(sys->requestSeek >= 0)
+        if(res)
         {
-            HtsMap map;
-            map.setData("method", "subscriptionSeek");
-            map.setData("subscriptionId", 1);
-            map.setData("time", (int64_t)sys->requestSeek);
-            map.setData("absolute", 1);
+            msg_Info(demux, "Reconnected to channel %d", sys->channelId);
 
-            ReadSuccess(demux, sys, map.makeMsg(), "seek");
+            if(resumeTime > 0 && sys->timeshiftPeriod > 0)
+            {
+                HtsMessageBuilder req(sys->txBuffer);
+                req.setData(HtsKeys::method, "subscriptionSeek");
+                req.setData(HtsKeys::subscriptionId, (uint32_t)sys->subscriptionId);
+                req.setData(HtsKeys::time, (int64_t)resumeTime);
+                req.setData(HtsKeys::absolute, 1);
 
-            sys->requestSeek = -1;
-        }
+                SendRequestAsync(demux, sys, req, LogFailure(demux, "resume timeshift"));
+            }
 
-        if(sys->doDisable)
-        {
-            vlc_mutex_lock(&sys->disableMutex);
+            return true;
+        }
 
-            std::shared_ptr<HtsList> enable = std::make_shared<HtsList>();
-            for(auto it = oldDisable.begin(); it != oldDisable.end(); ++it)
-                enable->appendData(std::make_shared<HtsInt>(*it));
+        CancelReconnect(sys);
+        sys->resumed = false;
 
-            std::shared_ptr<HtsList> disable = std::make_shared<HtsList>();;
+        delay = std::min(delay * 2, RECONNECT_DELAY_MAX);
+    }
 
-            for(auto it = sys->disables.begin(); it != sys->disables.end(); ++it)
-                disable->appendData(std::make_shared<HtsInt>(*it));
+    msg_Err(demux, "Giving up reconnecting to channel %d", sys->channelId);
+    return false;
+}
 
-            HtsMap map;
-            map.setData("method", "subscriptionFilterStream");
-            map.setData("subscriptionId", 1);
-            map.setData("enable", enable);
-            map.setData("disable", disable);
+// Sends whatever the control functions asked for since the last call
+static void SendControlRequests(demux_t *demux, std::list<int64_t> &oldDisable)
+{
+    demux_sys_t *sys = demux->p_sys;
+    bool sent = false;
+
+    // Control requests that are due together go out in one write, the
+    // replies are picked up by ReadMessage while packets keep flowing
+    CorkTransmit(sys);
+
+    int speed = sys->requestSpeed;
+    bool sentSpeed = false;
+    if(speed != INT_MIN)
+    {
+        HtsMessageBuilder req(sys->txBuffer);
+        req.setData(HtsKeys::method, "subscriptionSpeed");
+        req.setData(HtsKeys::subscriptionId, (uint32_t)sys->subscriptionId);
+        req.setData(HtsKeys::speed, speed);
 
-            if(!oldDisable.empty() || !sys->disables.empty())
-                ReadSuccess(demux, sys, map.makeMsg(), "filterStream");
+        sentSpeed = SendRequestAsync(demux, sys, req, LogFailure(demux, "set speed")) != 0;
+    }
+
+    int64_t seek = sys->requestSeek;
+    bool sentSeek = false;
+    if(seek >= 0)
+    {
+        HtsMessageBuilder req(sys->txBuffer);
+        req.setData(HtsKeys::method, "subscriptionSeek");
+        req.setData(HtsKeys::subscriptionId, (uint32_t)sys->subscriptionId);
+        req.setData(HtsKeys::time, seek);
+        req.setData(HtsKeys::absolute, 1);
+
+        sentSeek = SendRequestAsync(demux, sys, req, LogFailure(demux, "seek")) != 0;
+    }
+
+    if(sys->doDisable)
+    {
+        bool sentDisable = true;
+        if(!oldDisable.empty() || !sys->disables.empty())
+        {
+            HtsMessageBuilder req(sys->txBuffer);
+            req.setData(HtsKeys::method, "subscriptionFilterStream");
+            req.setData(HtsKeys::subscriptionId, (uint32_t)sys->subscriptionId);
+            req.setData(HtsKeys::enable, oldDisable);
+            req.setData(HtsKeys::disable, sys->disables);
+
+            sentDisable = SendRequestAsync(demux, sys, req, LogFailure(demux, "filterStream")) != 0;
+        }
 
+        if(sentDisable)
+        {
             sys->doDisable = false;
             oldDisable = sys->disables;
-            vlc_mutex_unlock(&sys->disableMutex);
+            sent = true;
         }
     }
 
+    // Requests that didn't make it out, with the connection down, are
+    // kept and go out again once it is back. Newer ones made meanwhile
+    // are left for the next round.
+    if(UncorkTransmit(demux, sys))
+    {
+        if(sentSpeed)
+            sent |= sys->requestSpeed.compare_exchange_strong(speed, INT_MIN);
+        if(sentSeek)
+            sent |= sys->requestSeek.compare_exchange_strong(seek, -1);
+    }
+
+    mtime_t requested = sys->requestTime.exchange(0);
+    if(sent && requested != 0)
+        sys->requestLatency.add(mdate() - requested);
+}
+
+void * RunHTSP(void *obj)
+{
+    demux_t *demux = (demux_t*)obj;
+    demux_sys_t *sys = demux->p_sys;
+    std::list<int64_t> oldDisable;
+    mtime_t throttleStart = 0;
+
+    for(;;)
+    {
+        // First thing on every round, whichever way the last one ended: the
+        // wakeup that came with a request is gone once it was waited for
+        SendControlRequests(demux, oldDisable);
+
+        // While the demuxer is behind the socket is left unread, so TCP
+        // pushes back and the server's own queueDepth and drops kick in
+        bool throttled = sys->throttled ? !sys->msgQueue.drained() : sys->msgQueue.full();
+        sys->throttled = throttled;
+
+        // DemuxHTSP only wakes us up if it saw the flag, it may have
+        // drained the ring just before
+        if(throttled && sys->msgQueue.drained())
+        {
+            sys->throttled = false;
+            throttled = false;
+        }
+
+        if(throttled)
+        {
+            if(throttleStart == 0)
+            {
+                msg_Dbg(demux, "Demuxer is behind, pausing reads");
+                throttleStart = mdate();
+                sys->throttles++;
+            }
+
+            WaitWakeup(demux, sys);
+            continue;
+        }
+
+        if(throttleStart != 0)
+        {
+            sys->throttledTime += mdate() - throttleStart;
+            throttleStart = 0;
+        }
+
+        // Control requests go out as soon as they are made, not only when
+        // the next message comes in
+        if(!WaitMessage(demux, sys))
+            continue;
+
+        HtsMessage msg = ReadMessage(demux, sys);
+        if(!msg.isValid() && sys->netfd < 0 && sys->subscribed)
+        {
+            if(!ReconnectHTSP(demux))
+            {
+                AbortHTSP(demux);
+                return 0;
+            }
+
+            // The new subscription starts out with all streams enabled
+            oldDisable.clear();
+            continue;
+        }
+
+        HtsMessageHeader header;
+        if(!msg.isValid() || !HtsDecode(msg, header))
+        {
+            AbortHTSP(demux);
+            return 0;
+        }
+
+        // Messages of an earlier subscription on a reused session. Those
+        // that aren't about a subscription at all are passed on.
+        if(header.has(HtsMessageHeader::FIELD_subscriptionId) && header.subscriptionId != sys->subscriptionId)
+            continue;
+
+        demux_item_t item;
+
+        if(header.method == "muxpkt")
+        {
+            // Packets that are dropped never reach the demuxer
+            if(!BuildBlock(demux, msg, &item) || item.block == 0)
+                continue;
+        }
+        else if(header.method == "timeshiftStatus")
+        {
+            ParseTimeshiftStatus(demux, msg);
+            continue;
+        }
+        else
+        {
+            if(header.method == "subscriptionStart")
+                TrackStreams(demux, msg);
+            else if(header.method == "subscriptionSkip")
+                TrackSkip(demux, msg);
+
+            item.msg = std::move(msg);
+        }
+
+        if(!sys->msgQueue.push(std::move(item)))
+            msg_Err(demux, "Message ring overrun, dropping message");
+    }
+
     return 0;
 }
 
+// Hands a control request over to the reading thread, which sends it
+static void RequestControl(demux_sys_t *sys)
+{
+    mtime_t none = 0;
+    sys->requestTime.compare_exchange_strong(none, mdate());
+    WakeupReader(sys);
+}
+
 int SeekHTSP(demux_t *demux, int64_t time, bool precise)
 {
     VLC_UNUSED(precise);
@@ -652,6 +1265,7 @@ int SeekHTSP(demux_t *demux, int64_t time, bool precise)
         return VLC_EGENERIC;
 
     sys->requestSeek = time;
+    RequestControl(sys);
 
     return VLC_SUCCESS;
 }
@@ -666,155 +1280,149 @@ int SpeedHTSP(demux_t *demux, int speed)
         return VLC_EGENERIC;
 
     sys->requestSpeed = speed;
+    RequestControl(sys);
 
     return VLC_SUCCESS;
 }
 
+// The EPG may come in on the reading thread, it is only ever handed to the
+// core from the demux thread
+static void UpdateEPG(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    vlc_epg_t *epg = sys->epg.exchange(0);
+    if(epg == 0)
+        return;
+
+    es_out_Control(demux->out, ES_OUT_SET_GROUP_EPG, (int)sys->channelId, epg);
+    vlc_epg_Delete(epg);
+}
+
+static bool SameStreams(demux_sys_t *sys, const std::vector<HtsStreamInfo> &streams)
+{
+    if(sys->stream == 0 || sys->streamCount != streams.size())
+        return false;
+
+    for(uint32_t i = 0; i < sys->streamCount; i++)
+        if(sys->stream[i].index != streams[i].index || streams[i].type != sys->stream[i].type.c_str())
+            return false;
+
+    return true;
+}
+
+// A resumed subscription carries on with the ES it had, only the timing
+// starts over, which the reading thread did already
+static void ResumeStreams(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    msg_Info(demux, "Subscription resumed, keeping %u elementary streams", sys->streamCount);
+
+    es_out_Control(demux->out, ES_OUT_RESET_PCR);
+}
+
 bool ParseSubscriptionStart(demux_t *demux, HtsMessage &msg)
 {
     demux_sys_t *sys = demux->p_sys;
 
-    if(sys->stream != 0)
-    {
-        for(uint32_t i = 0; i < sys->streamCount; i++)
-            if(sys->stream[i].es != 0)
-                es_out_Del(demux->out, sys->stream[i].es);
-        delete[] sys->stream;
-        sys->stream = 0;
-        sys->streamCount = 0;
-    }
+    HtsSubscriptionStart start;
+    HtsDecode(msg, start);
 
-    if(msg.getRoot()->contains("sourceinfo") && sys->epg != 0)
+    if(start.has(HtsSubscriptionStart::FIELD_sourceinfo))
     {
-        std::shared_ptr<HtsMap> srcinfo = msg.getRoot()->getMap("sourceinfo");
-
         vlc_meta_t *meta = vlc_meta_New();
-        vlc_meta_SetTitle(meta, srcinfo->getStr("service").c_str());
+        vlc_meta_SetTitle(meta, start.sourceinfo.service.str().c_str());
         es_out_Control(demux->out, ES_OUT_SET_GROUP_META, (int)sys->channelId, meta);
         vlc_meta_Delete(meta);
-
-        es_out_Control(demux->out, ES_OUT_SET_GROUP_EPG, (int)sys->channelId, sys->epg);
-        vlc_epg_Delete(sys->epg);
-        sys->epg = 0;
     }
 
-    std::shared_ptr<HtsList> streams = msg.getRoot()->getList("streams");
-    if(streams->count() <= 0)
+    UpdateEPG(demux);
+
+    std::vector<HtsStreamInfo> &streams = start.streams;
+    if(streams.empty())
     {
         msg_Err(demux, "Malformed SubscriptionStart!");
         return false;
     }
 
-    sys->streamCount = streams->count();
+    if(sys->resumed.exchange(false) && SameStreams(sys, streams))
+    {
+        ResumeStreams(demux);
+        return true;
+    }
+
+    if(sys->stream != 0)
+    {
+        for(uint32_t i = 0; i < sys->streamCount; i++)
+            if(sys->stream[i].es != 0)
+                es_out_Del(demux->out, sys->stream[i].es);
+        delete[] sys->stream;
+        sys->stream = 0;
+        sys->streamCount = 0;
+    }
+
+    sys->streamCount = streams.size();
     msg_Dbg(demux, "Found %d elementary streams", sys->streamCount);
 
     sys->stream = new hts_stream[sys->streamCount];
-    sys->hadIFrame = false;
-    sys->lastPcr = 0;
-    sys->currentPcr = 0;
-    sys->tsOffset = 0;
-
-    vlc_mutex_lock(&sys->disableMutex);
-    sys->disables.clear();
 
-    for(uint32_t jj = 0; jj < streams->count(); jj++)
+    for(uint32_t jj = 0; jj < streams.size(); jj++)
     {
-        std::shared_ptr<HtsData> sub = streams->getData(jj);
-        if(!sub->isMap())
-            continue;
-        std::shared_ptr<HtsMap> map = std::static_pointer_cast<HtsMap>(sub);
+        const HtsStreamInfo &info = streams[jj];
 
-        std::string type = map->getStr("type");
+        std::string type = info.type.str();
         if(type.empty())
             continue;
 
-        if(!map->contains("index"))
+        if(!info.has(HtsStreamInfo::FIELD_index))
             continue;
 
-        uint32_t index = map->getU32("index");
+        uint32_t index = info.index;
         sys->stream[jj].index = index;
+        sys->stream[jj].type = type;
 
         es_format_t *fmt = &(sys->stream[jj].fmt);
 
-        if(type == "AC3")
-        {
-            es_format_Init(fmt, AUDIO_ES, VLC_CODEC_A52);
-        }
-        else if(type == "EAC3")
-        {
-            es_format_Init(fmt, AUDIO_ES, VLC_CODEC_EAC3);
-        }
-        else if(type == "MPEG2AUDIO")
-        {
-            es_format_Init(fmt, AUDIO_ES, VLC_CODEC_MPGA);
-        }
-        else if(type == "AAC")
-        {
-            es_format_Init(fmt, AUDIO_ES, VLC_CODEC_MP4A);
-        }
-        else if(type == "VORBIS")
-        {
-            es_format_Init(fmt, AUDIO_ES, VLC_CODEC_VORBIS);
-        }
-        else if(type == "MPEG2VIDEO")
-        {
-            es_format_Init(fmt, VIDEO_ES, VLC_CODEC_MP2V);
-        }
-        else if(type == "H264")
-        {
-            es_format_Init(fmt, VIDEO_ES, VLC_CODEC_H264);
-        }
-        else if(type == "DVBSUB")
-        {
-            es_format_Init(fmt, SPU_ES, VLC_CODEC_DVBS);
-            sys->stream[jj].ignoreTime = true;
-        }
-        else if(type == "TEXTSUB")
-        {
-            es_format_Init(fmt, SPU_ES, VLC_CODEC_TEXT);
-            sys->stream[jj].ignoreTime = true;
-        }
-        else if(type == "TELETEXT")
-        {
-            es_format_Init(fmt, SPU_ES, VLC_CODEC_TELETEXT);
-            sys->stream[jj].ignoreTime = true;
-        }
-        else
+        const hts_stream_type *streamType = FindStreamType(info.type);
+        if(streamType == 0)
         {
             sys->stream[jj].es = 0;
-            sys->stream[jj].ignoreTime = true;
             continue;
         }
 
+        es_format_Init(fmt, streamType->cat, streamType->codec);
+
         if(fmt->i_cat == VIDEO_ES)
         {
+            // Filtered by the reading thread
             if(sys->audioOnly)
             {
                 sys->stream[jj].es = 0;
-                sys->disables.push_back(index);
                 continue;
             }
 
-            fmt->video.i_width = map->getU32("width");
-            fmt->video.i_height = map->getU32("height");
+            fmt->video.i_width = info.width;
+            fmt->video.i_height = info.height;
         }
         else if(fmt->i_cat == AUDIO_ES)
         {
-            fmt->audio.i_physical_channels = map->getU32("channels");
-            fmt->audio.i_rate = map->getU32("rate");
+            fmt->audio.i_physical_channels = info.channels;
+            fmt->audio.i_rate = info.rate;
         }
 
-        void *meta = 0;
-        uint32_t metalen = 0;
-        map->getBin("meta", &metalen, &meta);
-
-        if(meta)
+        if(info.meta.length > 0)
         {
-            fmt->i_extra = metalen;
-            fmt->p_extra = meta;
+            void *meta = malloc(info.meta.length);
+            if(meta)
+            {
+                memcpy(meta, info.meta.data, info.meta.length);
+                fmt->i_extra = info.meta.length;
+                fmt->p_extra = meta;
+            }
         }
 
-        std::string lang = map->getStr("language");
+        std::string lang = info.language.str();
         if(!lang.empty())
         {
             fmt->psz_language = (char*)malloc(lang.length()+1);
@@ -829,21 +1437,18 @@ bool ParseSubscriptionStart(demux_t *demux, HtsMessage &msg)
         msg_Dbg(demux, "Found elementary stream id %d, type %s", index, type.c_str());
     }
 
-    sys->doDisable = true;
-    vlc_mutex_unlock(&sys->disableMutex);
-
     return true;
 }
 
 bool ParseSubscriptionStop(demux_t *demux, HtsMessage &msg)
 {
-    msg_Info(demux, "HTS Subscription Stop: subscriptionId: %d, status: %s", msg.getRoot()->getU32("subscriptionId"), msg.getRoot()->getStr("status").c_str());
+    msg_Info(demux, "HTS Subscription Stop: subscriptionId: %d, status: %s", msg.getRoot()->getU32(HtsKeys::subscriptionId), msg.getRoot()->getStr(HtsKeys::status).c_str());
     return false;
 }
 
 bool ParseSubscriptionStatus(demux_t *demux, HtsMessage &msg)
 {
-    msg_Dbg(demux, "HTS Subscription Status: subscriptionId: %d, status: %s", msg.getRoot()->getU32("subscriptionId"), msg.getRoot()->getStr("status").c_str());
+    msg_Dbg(demux, "HTS Subscription Status: subscriptionId: %d, status: %s", msg.getRoot()->getU32(HtsKeys::subscriptionId), msg.getRoot()->getStr(HtsKeys::status).c_str());
     return true;
 }
 
@@ -851,19 +1456,22 @@ bool ParseQueueStatus(demux_t *demux, HtsMessage &msg)
 {
     demux_sys_t *sys = demux->p_sys;
 
-    uint32_t drops = msg.getRoot()->getU32("Bdrops") + msg.getRoot()->getU32("Pdrops") + msg.getRoot()->getU32("Idrops");
+    HtsQueueStatus status;
+    HtsDecode(msg, status);
+
+    uint32_t drops = status.Bdrops + status.Pdrops + status.Idrops;
     if(drops > sys->drops)
     {
 
         msg_Warn(demux, "Can't keep up! HTS dropped %d frames!", drops - sys->drops);
         msg_Warn(demux, "HTS Queue Status: subscriptionId: %d, Packets: %d, Bytes: %d, Delay: %lld, Bdrops: %d, Pdrops: %d, Idrops: %d",
-            msg.getRoot()->getU32("subscriptionId"),
-            msg.getRoot()->getU32("packets"),
-            msg.getRoot()->getU32("bytes"),
-            (long long int)msg.getRoot()->getS64("delay"),
-            msg.getRoot()->getU32("Bdrops"),
-            msg.getRoot()->getU32("Pdrops"),
-            msg.getRoot()->getU32("Idrops"));
+            (uint32_t)status.subscriptionId,
+            (uint32_t)status.packets,
+            (uint32_t)status.bytes,
+            (long long int)status.delay,
+            (uint32_t)status.Bdrops,
+            (uint32_t)status.Pdrops,
+            (uint32_t)status.Idrops);
 
         sys->drops += drops;
     }
@@ -877,28 +1485,216 @@ bool ParseSignalStatus(demux_t *demux, HtsMessage &msg)
     return true;
 }
 
-bool ParseMuxPacket(demux_t *demux, HtsMessage &msg)
+void ReleaseHtsBlock(block_t *block)
+{
+    delete (hts_block_t*)block;
+}
+
+block_t *BlockFromMessage(HtsMessage &msg, const void *buf, uint32_t len)
+{
+    // Failing here drops the packet, VLC can't take an exception
+    hts_block_t *hblock = new (std::nothrow) hts_block_t;
+    if(unlikely(hblock == 0))
+        return 0;
+
+    block_Init(&hblock->block, (void*)buf, len);
+    hblock->block.pf_release = ReleaseHtsBlock;
+    hblock->buffer = msg.getBuffer();
+
+    return &hblock->block;
+}
+
+/* The reading thread follows the streams and the timing of the
+ * subscription on its own, to build blocks ready to send. The demuxer
+ * creates the ES from the same subscriptionStart, and only sends. */
+
+static bool IsDisabled(demux_sys_t *sys, uint32_t index)
+{
+    if(index >= MAX_STREAM_INDEX)
+        return false;
+    return (sys->disabled[index / 64].load(std::memory_order_relaxed) >> (index % 64)) & 1;
+}
+
+static void ResetPcr(demux_sys_t *sys)
+{
+    for(size_t i = 0; i < sys->tracks.size(); i++)
+    {
+        sys->tracks[i].lastDts = 0;
+        sys->tracks[i].silent = false;
+    }
+
+    sys->pcrMin = 0;
+    sys->pcrTrack = -1;
+    sys->pcrNext = 0;
+    sys->maxDts = 0;
+    sys->lastPcr = 0;
+    sys->currentPcr = 0;
+}
+
+static void ResetTiming(demux_sys_t *sys)
+{
+    ResetPcr(sys);
+
+    sys->hadIFrame = false;
+    sys->tsOffset = 0;
+}
+
+static void ScanPcr(demux_sys_t *sys)
+{
+    sys->pcrMin = 0;
+    sys->pcrTrack = -1;
+    sys->pcrNext = 0;
+    sys->pcrScans++;
+
+    for(uint32_t i = 0; i < sys->tracks.size(); i++)
+    {
+        hts_track &track = sys->tracks[i];
+        if(track.lastDts <= 0 || track.silent)
+            continue;
+
+        if(track.lastDts + PCR_SILENT_TIME < sys->maxDts)
+        {
+            track.silent = true;
+            sys->pcrSilenced++;
+            continue;
+        }
+
+        if(sys->pcrTrack == -1 || track.lastDts < sys->pcrMin)
+        {
+            sys->pcrNext = sys->pcrMin;
+            sys->pcrMin = track.lastDts;
+            sys->pcrTrack = i;
+        }
+        else if(sys->pcrNext == 0 || track.lastDts < sys->pcrNext)
+            sys->pcrNext = track.lastDts;
+    }
+}
+
+// Takes the DTS of a timed stream, sys->pcrMin is the PCR it allows
+static void UpdatePcr(demux_sys_t *sys, int streamIndex, mtime_t dts)
+{
+    hts_track &track = sys->tracks[streamIndex];
+    track.lastDts = dts;
+    track.silent = false;
+
+    if(dts > sys->maxDts)
+        sys->maxDts = dts;
+
+    if(sys->pcrTrack == -1 || sys->pcrMin + PCR_SILENT_TIME < sys->maxDts)
+        ScanPcr(sys);
+    else if(sys->pcrTrack == streamIndex)
+    {
+        // Still the lowest until it passes the next one
+        if(sys->pcrNext == 0 || dts <= sys->pcrNext)
+            sys->pcrMin = dts;
+        else
+            ScanPcr(sys);
+    }
+    else if(dts < sys->pcrMin)
+    {
+        sys->pcrNext = sys->pcrMin;
+        sys->pcrMin = dts;
+        sys->pcrTrack = streamIndex;
+    }
+    else if(sys->pcrNext == 0 || dts < sys->pcrNext)
+        sys->pcrNext = dts;
+}
+
+static void TrackStreams(demux_t *demux, HtsMessage &msg)
 {
     demux_sys_t *sys = demux->p_sys;
 
-    uint32_t index = msg.getRoot()->getU32("stream");
+    HtsSubscriptionStart start;
+    HtsDecode(msg, start);
+
+    // Positions match sys->stream, as ParseSubscriptionStart will set it up
+    sys->tracks.assign(start.streams.size(), hts_track());
+
+    uint32_t maxIndex = 0;
+    for(uint32_t jj = 0; jj < start.streams.size(); jj++)
+        if(start.streams[jj].index > maxIndex && start.streams[jj].index < MAX_STREAM_INDEX)
+            maxIndex = start.streams[jj].index;
+    sys->trackByIndex.assign(maxIndex + 1, -1);
+
+    uint64_t disabled[MAX_STREAM_INDEX / 64] = { 0 };
 
-    vlc_mutex_lock(&sys->disableMutex);
-    for(auto it = sys->disables.begin(); it != sys->disables.end(); ++it)
+    sys->disables.clear();
+
+    for(uint32_t jj = 0; jj < start.streams.size(); jj++)
     {
-        if(*it == index)
+        const HtsStreamInfo &info = start.streams[jj];
+        hts_track &track = sys->tracks[jj];
+
+        if(info.type.empty() || !info.has(HtsStreamInfo::FIELD_index))
+            continue;
+
+        uint32_t index = info.index;
+        track.index = index;
+        if(index < sys->trackByIndex.size())
+            sys->trackByIndex[index] = jj;
+
+        const hts_stream_type *streamType = FindStreamType(info.type);
+        if(streamType == 0)
+            continue;
+
+        if(streamType->cat == VIDEO_ES && sys->audioOnly)
         {
-            vlc_mutex_unlock(&sys->disableMutex);
-            return true;
+            sys->disables.push_back(index);
+            if(index < MAX_STREAM_INDEX)
+                disabled[index / 64] |= (uint64_t)1 << (index % 64);
+            continue;
         }
+
+        track.active = true;
+        track.video = (streamType->cat == VIDEO_ES);
+        track.ignoreTime = streamType->ignoreTime;
     }
-    vlc_mutex_unlock(&sys->disableMutex);
 
-    void *bin = 0;
-    uint32_t binlen = 0;
-    msg.getRoot()->getBin("payload", &binlen, &bin);
+    for(uint32_t i = 0; i < MAX_STREAM_INDEX / 64; i++)
+        sys->disabled[i].store(disabled[i], std::memory_order_relaxed);
+
+    // Sent by SendControlRequests() on the way round
+    sys->doDisable = true;
+
+    ResetTiming(sys);
+}
+
+static void TrackSkip(demux_t *demux, HtsMessage &msg)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    if(msg.getRoot()->contains(HtsKeys::error) || msg.getRoot()->contains(HtsKeys::size) || !msg.getRoot()->contains(HtsKeys::time))
+        return;
+
+    int64_t newTime = msg.getRoot()->getS64(HtsKeys::time);
+
+    if(!msg.getRoot()->getU32(HtsKeys::absolute))
+        newTime += sys->currentPcr;
+
+    msg_Info(demux, "SubscriptionSkip: newTime: %lld, base: %s", (long long int)newTime, (msg.getRoot()->getU32(HtsKeys::absolute))?"abs":"rel");
+
+    ResetPcr(sys);
+
+    sys->tsOffset = 0;
+}
+
+// Returns false for a malformed packet. Packets that are dropped leave
+// item->block empty.
+static bool BuildBlock(demux_t *demux, HtsMessage &msg, demux_item_t *item)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    HtsMuxPacket pkt;
+    HtsDecode(msg, pkt);
+
+    uint32_t index = pkt.stream;
+
+    if(IsDisabled(sys, index))
+        return true;
+
+    const void *bin = pkt.payload.data;
+    uint32_t binlen = pkt.payload.length;
 
-    int64_t pts = 0;
     int64_t dts = 0;
 
     uint32_t frametype = 0;
@@ -911,25 +1707,23 @@ bool ParseMuxPacket(demux_t *demux, HtsMessage &msg)
 
     if(index == 0 || binlen == 0)
     {
-        free(bin);
         msg_Err(demux, "Malformed Mux Packet!");
         return false;
     }
 
-    if(index == 0)
-    {
-        free(bin);
-        msg_Err(demux, "Invalid stream index detected: %d with %d streams", index, sys->streamCount);
-        return false;
-    }
-
     int streamIndex = -1;
-    for(uint32_t i = 0; i < sys->streamCount; i++)
+    if(index < sys->trackByIndex.size())
+        streamIndex = sys->trackByIndex[index];
+    else
     {
-        if (index == sys->stream[i].index)
+        // Beyond the table, not seen from tvheadend so far
+        for(uint32_t i = 0; i < sys->tracks.size(); i++)
         {
-            streamIndex = i;
-            break;
+            if(index == sys->tracks[i].index)
+            {
+                streamIndex = i;
+                break;
+            }
         }
     }
 
@@ -939,49 +1733,39 @@ bool ParseMuxPacket(demux_t *demux, HtsMessage &msg)
         return false;
     }
 
-    if(sys->stream[streamIndex].es == 0)
-    {
-        free(bin);
+    hts_track &track = sys->tracks[streamIndex];
+    if(!track.active)
         return true;
-    }
 
-    block_t *block = block_Alloc(binlen);
+    block_t *block = BlockFromMessage(msg, bin, binlen);
     if(unlikely(block == 0))
-    {
-        free(bin);
         return false;
-    }
 
-    memcpy(block->p_buffer, bin, binlen);
-    free(bin);
-    bin = 0;
-
-    pts = block->i_pts = VLC_TS_INVALID;
-    if(msg.getRoot()->contains("pts"))
-        pts = block->i_pts = msg.getRoot()->getS64("pts");
+    block->i_pts = VLC_TS_INVALID;
+    if(pkt.has(HtsMuxPacket::FIELD_pts))
+        block->i_pts = pkt.pts;
 
     dts = block->i_dts = VLC_TS_INVALID;
-    if(msg.getRoot()->contains("dts"))
-        dts = block->i_dts = msg.getRoot()->getS64("dts");
+    if(pkt.has(HtsMuxPacket::FIELD_dts))
+        dts = block->i_dts = pkt.dts;
 
-    int64_t duration = msg.getRoot()->getS64("duration");
+    int64_t duration = pkt.duration;
     if(duration != 0)
         block->i_length = duration;
 
-    if(pts > 0 && !sys->stream[streamIndex].ignoreTime)
-        sys->stream[streamIndex].lastPts = pts;
-    if(dts > 0 && !sys->stream[streamIndex].ignoreTime)
-        sys->stream[streamIndex].lastDts = dts;
+    // Frames dropped until the first I frame still move the clock, or the
+    // PCR would wait for them to go silent
+    if(dts > 0 && !track.ignoreTime)
+        UpdatePcr(sys, streamIndex, dts);
 
-    frametype = msg.getRoot()->getU32("frametype");
-    if(sys->stream[streamIndex].fmt.i_cat == VIDEO_ES && frametype != 0)
+    frametype = pkt.frametype;
+    if(track.video && frametype != 0)
     {
         char ft = (char)frametype;
 
         if(!sys->hadIFrame && ft != 'I')
         {
             block_Release(block);
-            free(bin);
             return true;
         }
 
@@ -996,59 +1780,41 @@ bool ParseMuxPacket(demux_t *demux, HtsMessage &msg)
             block->i_flags = BLOCK_FLAG_TYPE_P;
     }
 
-    mtime_t pcr = 0;
-    for(uint32_t i = 0; i < sys->streamCount; i++)
-    {
-        if(sys->stream[i].lastDts > 0 && (sys->stream[i].lastDts < pcr || pcr == 0))
-        {
-            pcr = sys->stream[i].lastDts;
-        }
-    }
-
-    if(pcr > sys->currentPcr)
-        sys->currentPcr = pcr;
-
+    mtime_t pcr = sys->pcrMin;
     if(pcr > 0)
     {
+        if(pcr > sys->currentPcr)
+            sys->currentPcr = pcr;
+
         if(sys->lastPcr == 0)
         {
             sys->lastPcr = pcr;
         }
-        else if(pcr > sys->lastPcr + sys->ptsDelay && pcr > 0)
+        else if(pcr > sys->lastPcr + sys->pcrInterval)
         {
-            es_out_Control(demux->out, ES_OUT_SET_PCR, VLC_TS_0 + pcr);
+            item->pcr = pcr;
             sys->lastPcr = pcr;
+            sys->pcrSent++;
+            sys->pcrLag.add(sys->maxDts - pcr);
         }
     }
 
-    es_out_Send(demux->out, sys->stream[streamIndex].es, block);
+    item->block = block;
+    item->stream = streamIndex;
 
     return true;
 }
 
 bool ParseSubscriptionSkip(demux_t *demux, HtsMessage &msg)
 {
-    demux_sys_t *sys = demux->p_sys;
-
-    if(msg.getRoot()->contains("error") || msg.getRoot()->contains("size") || !msg.getRoot()->contains("time"))
+    if(msg.getRoot()->contains(HtsKeys::error) || msg.getRoot()->contains(HtsKeys::size) || !msg.getRoot()->contains(HtsKeys::time))
         return true;
 
-    int64_t newTime = msg.getRoot()->getS64("time");
-
-    if(!msg.getRoot()->getU32("absolute"))
-        newTime += sys->currentPcr;
-
-    msg_Info(demux, "SubscriptionSkip: newTime: %lld, base: %s", (long long int)newTime, (msg.getRoot()->getU32("absolute"))?"abs":"rel");
-
+    // The reading thread reset its timing already
     es_out_Control(demux->out, ES_OUT_RESET_PCR);
 
     msg_Info(demux, "PCR Reset done");
 
-    sys->lastPcr = 0;
-    sys->currentPcr = 0;
-
-    sys->tsOffset = 0;
-
     return true;
 }
 
@@ -1059,42 +1825,57 @@ int ParseSubscriptionSpeed(demux_t *demux, HtsMessage &msg)
     return true;
 }
 
-int DemuxHTSP(demux_t *demux)
+static int SendBlock(demux_t *demux, demux_item_t &item)
 {
     demux_sys_t *sys = demux->p_sys;
-    if(sys->channelId == 0)
-        return DEMUX_EOF;
 
-    vlc_mutex_lock(&sys->queueMutex);
-    if(sys->msgQueue.size() == 0)
-        vlc_cond_wait(&sys->queueCond, &sys->queueMutex);
-    if(sys->msgQueue.size() == 0)
-    {
-        vlc_mutex_unlock(&sys->queueMutex);
+    if(item.stream >= sys->streamCount || sys->stream[item.stream].es == 0)
+        return DEMUX_OK;
+
+    // Disabled while the block was queued
+    if(IsDisabled(sys, sys->stream[item.stream].index))
         return DEMUX_OK;
+
+    if(item.pcr > 0)
+        es_out_Control(demux->out, ES_OUT_SET_PCR, VLC_TS_0 + item.pcr);
+
+    if(unlikely(!sys->hadFirstFrame))
+    {
+        sys->hadFirstFrame = true;
+        msg_Info(demux, "First frame %lld ms after open", (long long int)(mdate() - sys->openTime) / 1000);
     }
-    HtsMessage msg = sys->msgQueue.front();
-    sys->msgQueue.pop();
-    vlc_mutex_unlock(&sys->queueMutex);
+
+    es_out_Send(demux->out, sys->stream[item.stream].es, item.block);
+    item.block = 0;
+
+    return DEMUX_OK;
+}
+
+static int HandleMessage(demux_t *demux, demux_item_t &item)
+{
+    demux_sys_t *sys = demux->p_sys;
+
+    if(item.block)
+        return SendBlock(demux, item);
+
+    HtsMessage &msg = item.msg;
     if(!msg.isValid())
         return DEMUX_EOF;
 
-    std::string method = msg.getRoot()->getStr("method");
+    if(sys->stream != 0 && sys->epg.load() != 0)
+        UpdateEPG(demux);
+
+    HtsMessageHeader header;
+    HtsDecode(msg, header);
+
+    HtsStrView method = header.method;
     if(method.empty())
         return DEMUX_ERROR;
 
-    uint32_t subs = msg.getRoot()->getU32("subscriptionId");
-    if(subs != 1)
+    if(header.has(HtsMessageHeader::FIELD_subscriptionId) && header.subscriptionId != sys->subscriptionId)
         return DEMUX_OK;
 
-    if(method == "muxpkt")
-    {
-        if(!ParseMuxPacket(demux, msg))
-        {
-            return DEMUX_ERROR;
-        }
-    }
-    else if(method == "subscriptionStart")
+    if(method == "subscriptionStart")
     {
         if(!ParseSubscriptionStart(demux, msg))
         {
@@ -1145,8 +1926,41 @@ int DemuxHTSP(demux_t *demux)
     }
     else
     {
-        msg_Warn(demux, "Ignoring packet of unknown method \"%s\"", method.c_str());
+        msg_Warn(demux, "Ignoring packet of unknown method \"%.*s\"", (int)method.length, method.data);
     }
 
     return DEMUX_OK;
 }
+
+int DemuxHTSP(demux_t *demux)
+{
+    demux_sys_t *sys = demux->p_sys;
+    if(sys->channelId == 0)
+        return DEMUX_EOF;
+
+    if(!sys->msgQueue.wait(DEMUX_WAIT_TIMEOUT))
+        return sys->aborted ? DEMUX_EOF : DEMUX_OK;
+
+    // Whatever is there already is handled back to back, within limits so
+    // that the input thread still gets to its controls in time
+    mtime_t deadline = sys->batchTime > 0 ? mdate() + sys->batchTime : 0;
+    uint32_t count = 0;
+    int res = DEMUX_OK;
+
+    demux_item_t item;
+    while(res == DEMUX_OK && count < sys->batchMessages && sys->msgQueue.pop(&item))
+    {
+        if(sys->throttled && sys->msgQueue.drained() && sys->throttled.exchange(false))
+            WakeupReader(sys);
+
+        res = HandleMessage(demux, item);
+        count++;
+
+        if(deadline != 0 && mdate() >= deadline)
+            break;
+    }
+
+    sys->batchSizes.add(count);
+
+    return res;
+}
@@ -80,12 +80,12 @@ bool ConnectSD(services_discovery_t *sd)
         return false;
     }
 
-    HtsMap map;
-    map.setData("method", "hello");
-    map.setData("clientname", "VLC media player");
-    map.setData("htspversion", HTSP_PROTO_VERSION);
+    HtsMessageBuilder hello(sys->txBuffer);
+    hello.setData(HtsKeys::method, "hello");
+    hello.setData(HtsKeys::clientname, "VLC media player");
+    hello.setData(HtsKeys::htspversion, HTSP_PROTO_VERSION);
 
-    HtsMessage m = ReadResult(sd, sys, map.makeMsg());
+    HtsMessage m = ReadResult(sd, sys, hello);
     if(!m.isValid())
     {
         msg_Err(sd, "No valid hello response");
@@ -94,11 +94,11 @@ bool ConnectSD(services_discovery_t *sd)
 
     uint32_t chall_len;
     void * chall;
-    m.getRoot()->getBin("challenge", &chall_len, &chall);
+    m.getRoot()->getBin(HtsKeys::challenge, &chall_len, &chall);
 
-    std::string serverName = m.getRoot()->getStr("servername");
-    std::string serverVersion = m.getRoot()->getStr("serverversion");
-    uint32_t protoVersion = m.getRoot()->getU32("htspversion");
+    std::string serverName = m.getRoot()->getStr(HtsKeys::servername);
+    std::string serverVersion = m.getRoot()->getStr(HtsKeys::serverversion);
+    uint32_t protoVersion = m.getRoot()->getU32(HtsKeys::htspversion);
 
     msg_Info(sd, "Connected to HTSP Server %s, version %s, protocol %d", serverName.c_str(), serverVersion.c_str(), protoVersion);
     if(protoVersion < HTSP_PROTO_VERSION)
@@ -115,9 +115,9 @@ bool ConnectSD(services_discovery_t *sd)
     if(user == 0 || user[0] == 0)
         return true;
 
-    map = HtsMap();
-    map.setData("method", "authenticate");
-    map.setData("username", user);
+    HtsMessageBuilder auth(sys->txBuffer);
+    auth.setData(HtsKeys::method, "authenticate");
+    auth.setData(HtsKeys::username, user);
 
     if(pass != 0 && pass[0] != 0 && chall)
     {
@@ -130,9 +130,7 @@ bool ConnectSD(services_discovery_t *sd)
         hts_sha1_update(shactx, (const uint8_t *)chall, chall_len);
         hts_sha1_final(shactx, d);
 
-        std::shared_ptr<HtsBin> bin = std::make_shared<HtsBin>();
-        bin->setBin(20, d);
-        map.setData("digest", bin);
+        auth.setData(HtsKeys::digest, d, 20);
 
         free(shactx);
     }
@@ -146,7 +144,7 @@ bool ConnectSD(services_discovery_t *sd)
     if(chall)
         free(chall);
 
-    bool res = ReadSuccess(sd, sys, map.makeMsg(), "authenticate");
+    bool res = ReadSuccess(sd, sys, auth, "authenticate");
     if(res)
         msg_Info(sd, "Successfully authenticated!");
     else
@@ -158,9 +156,9 @@ bool GetChannels(services_discovery_t *sd)
 {
     services_discovery_sys_t *sys = sd->p_sys;
 
-    HtsMap map;
-    map.setData("method", "enableAsyncMetadata");
-    if(!ReadSuccess(sd, sys, map.makeMsg(), "enable async metadata"))
+    HtsMessageBuilder req(sys->txBuffer);
+    req.setData(HtsKeys::method, "enableAsyncMetadata");
+    if(!ReadSuccess(sd, sys, req, "enable async metadata"))
         return false;
 
     std::list<uint32_t> channelIds;
@@ -169,7 +167,7 @@ bool GetChannels(services_discovery_t *sd)
     HtsMessage m;
     while((m = ReadMessage(sd, sys)).isValid())
     {
-        std::string method = m.getRoot()->getStr("method");
+        HtsStrView method = m.getRoot()->getStrView(HtsKeys::method);
         if(method.empty() || method == "initialSyncCompleted")
         {
             msg_Info(sd, "Finished getting initial metadata sync");
@@ -178,11 +176,11 @@ bool GetChannels(services_discovery_t *sd)
 
         if(method == "channelAdd")
         {
-            if(!m.getRoot()->contains("channelId"))
+            if(!m.getRoot()->contains(HtsKeys::channelId))
                 continue;
-            uint32_t cid = m.getRoot()->getU32("channelId");
+            uint32_t cid = m.getRoot()->getU32(HtsKeys::channelId);
 
-            std::string cname = m.getRoot()->getStr("channelName");
+            std::string cname = m.getRoot()->getStr(HtsKeys::channelName);
             if(cname.empty())
             {
                 std::ostringstream ss;
@@ -190,9 +188,9 @@ bool GetChannels(services_discovery_t *sd)
                 cname = ss.str();
             }
 
-            uint32_t cnum = m.getRoot()->getU32("channelNumber");
+            uint32_t cnum = m.getRoot()->getU32(HtsKeys::channelNumber);
 
-            std::string cicon = m.getRoot()->getStr("channelIcon");
+            std::string cicon = m.getRoot()->getStr(HtsKeys::channelIcon);
 
             std::ostringstream oss;
             oss << "htsp://";
@@ -230,14 +228,14 @@ bool GetChannels(services_discovery_t *sd)
         }
         else if(method == "tagAdd" || method == "tagUpdate")
         {
-            if(!m.getRoot()->contains("tagId") || !m.getRoot()->contains("tagName"))
+            if(!m.getRoot()->contains(HtsKeys::tagId) || !m.getRoot()->contains(HtsKeys::tagName))
                 continue;
 
-            std::string tagName = m.getRoot()->getStr("tagName");
+            std::string tagName = m.getRoot()->getStr(HtsKeys::tagName);
 
-            std::shared_ptr<HtsList> chList = m.getRoot()->getList("members");
-            for(uint32_t i = 0; i < chList->count(); ++i)
-                channels[chList->getData(i)->getU32()].tags.push_back(tagName);
+            HtsList chList = m.getRoot()->getList(HtsKeys::members);
+            for(uint32_t i = 0; i < chList.count(); ++i)
+                channels[chList.getData(i).getU32()].tags.push_back(tagName);
         }
     }
 
@@ -288,14 +286,17 @@ void * RunSD(void *obj)
         if(!msg.isValid())
             break;
 
-        std::string method = msg.getRoot()->getStr("method");
+        HtsStrView method = msg.getRoot()->getStrView(HtsKeys::method);
         if(method.empty())
             break;
 
-        msg_Dbg(sd, "Got Message with method %s", method.c_str());
+        msg_Dbg(sd, "Got Message with method %.*s", (int)method.length, method.data);
     }
 
+    // Not handed to the session registry: async metadata is enabled on it,
+    // which a demuxer would have to read and throw away
     net_Close(sys->netfd);
+    sys->netfd = -1;
 
     return 0;
 }
@@ -18,19 +18,263 @@
 
 #define __STDC_CONSTANT_MACROS 1
 
+#include <algorithm>
+#include <cerrno>
 #include <ctime>
+#include <list>
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef _WIN32
+# include <poll.h>
+#endif
+#ifdef __linux__
+# include <sys/eventfd.h>
+#endif
 
 #include "helper.h"
 #include "htsmessage.h"
+#include "htsschema.h"
 
 #include <vlc_common.h>
 #include <vlc_network.h>
+#include <vlc_threads.h>
+#if !defined(__linux__) && !defined(_WIN32)
+# include <vlc_fs.h>
+#endif
+
+// The VLC headers only declare vlc_poll() where poll() is missing or can't
+// be cancelled, poll() is a cancellation point everywhere else
+static int Poll(struct pollfd *fds, unsigned nfds, int timeout)
+{
+#ifdef _WIN32
+    return vlc_poll(fds, nfds, timeout);
+#else
+    return poll(fds, nfds, timeout);
+#endif
+}
+
+Notify::Notify()
+    :signalled(false)
+{
+    fd[0] = fd[1] = -1;
+    vlc_mutex_init(&lock);
+    vlc_cond_init(&cond);
+}
+
+Notify::~Notify()
+{
+    if(fd[0] >= 0)
+        close(fd[0]);
+    if(fd[1] >= 0 && fd[1] != fd[0])
+        close(fd[1]);
+
+    vlc_cond_destroy(&cond);
+    vlc_mutex_destroy(&lock);
+}
+
+bool Notify::open()
+{
+#if defined(__linux__)
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(efd < 0)
+        return false;
+    fd[0] = fd[1] = efd;
+    return true;
+#elif defined(_WIN32)
+    // Only sockets can be polled for there
+    return false;
+#else
+    if(vlc_pipe(fd))
+        return false;
+
+    for(int i = 0; i < 2; i++)
+    {
+        int flags = fcntl(fd[i], F_GETFL);
+        if(flags == -1 || fcntl(fd[i], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            close(fd[0]);
+            close(fd[1]);
+            fd[0] = fd[1] = -1;
+            return false;
+        }
+    }
+    return true;
+#endif
+}
 
+void Notify::signal()
+{
+    if(fd[1] < 0)
+    {
+        vlc_mutex_lock(&lock);
+        signalled = true;
+        vlc_cond_signal(&cond);
+        vlc_mutex_unlock(&lock);
+        return;
+    }
+
+    // A full pipe or counter is signalled already
+    uint64_t one = 1;
+#ifdef __linux__
+    ssize_t res = write(fd[1], &one, sizeof(one));
+#else
+    ssize_t res = write(fd[1], &one, 1);
+#endif
+    VLC_UNUSED(res);
+}
+
+void Notify::clear()
+{
+    if(fd[0] < 0)
+    {
+        vlc_mutex_lock(&lock);
+        signalled = false;
+        vlc_mutex_unlock(&lock);
+        return;
+    }
+
+    uint64_t buf[8];
+    while(read(fd[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+void Notify::wait(mtime_t timeout)
+{
+    if(fd[0] >= 0)
+    {
+        struct pollfd ufd;
+        ufd.fd = fd[0];
+        ufd.events = POLLIN;
+
+        if(Poll(&ufd, 1, timeout < 0 ? -1 : timeout / 1000) > 0)
+            clear();
+        return;
+    }
+
+    mtime_t deadline = mdate() + timeout;
+
+    vlc_mutex_lock(&lock);
+    mutex_cleanup_push(&lock);
+    while(!signalled)
+    {
+        if(timeout < 0)
+            vlc_cond_wait(&cond, &lock);
+        else if(vlc_cond_timedwait(&cond, &lock, deadline))
+            break;
+    }
+    signalled = false;
+    vlc_cleanup_pop();
+    vlc_mutex_unlock(&lock);
+}
 
 sys_common_t::~sys_common_t()
 {
     if(netfd >= 0)
         net_Close(netfd);
+
+    arenas->close();
+    delete[] rxBuffer;
+}
+
+Histogram::Histogram()
+    :count(0)
+    ,total(0)
+    ,max(0)
+{
+    memset(buckets, 0, sizeof(buckets));
+}
+
+void Histogram::add(int64_t value)
+{
+    if(value < 0)
+        value = 0;
+
+    uint32_t bucket = 0;
+    while(bucket < HISTOGRAM_BUCKETS - 1 && value >= ((int64_t)1 << bucket))
+        bucket++;
+
+    buckets[bucket]++;
+    count++;
+    total += value;
+    if(value > max)
+        max = value;
+}
+
+void Histogram::dump(vlc_object_t *obj, const char *name, const char *unit) const
+{
+    if(count == 0)
+        return;
+
+    msg_Dbg(obj, "%s: %u samples, avg %lld %s, max %lld %s", name, count, (long long int)(total / count), unit, (long long int)max, unit);
+    for(uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        if(buckets[i] > 0)
+            msg_Dbg(obj, "%s: < %lld %s: %u", name, (long long int)1 << i, unit, buckets[i]);
+}
+
+MessageQueue::MessageQueue()
+    :bytes(0)
+    ,maxMessages(MAX_QUEUE_SIZE)
+    ,maxBytes(MAX_QUEUE_BYTES)
+    ,peakMessages(0)
+    ,peakBytes(0)
+{}
+
+void MessageQueue::setBudget(uint32_t messages, uint64_t bytes)
+{
+    maxMessages = messages;
+    maxBytes = bytes;
+}
+
+void MessageQueue::push(HtsMessage &&m)
+{
+    bytes += m.getLength();
+    messages.push_back(std::move(m));
+
+    if(messages.size() > peakMessages)
+        peakMessages = messages.size();
+    if(bytes > peakBytes)
+        peakBytes = bytes;
+}
+
+HtsMessage MessageQueue::pop()
+{
+    return take(messages.begin());
+}
+
+HtsMessage MessageQueue::take(iterator it)
+{
+    HtsMessage res = std::move(*it);
+    messages.erase(it);
+    bytes -= res.getLength();
+    return res;
+}
+
+void MessageQueue::clear()
+{
+    messages.clear();
+    bytes = 0;
+}
+
+void MessageQueue::swap(MessageQueue &other)
+{
+    std::swap(*this, other);
+}
+
+void MessageQueue::dump(vlc_object_t *obj, const char *name) const
+{
+    msg_Dbg(obj, "%s: peak %u messages, %llu bytes of %u messages, %llu bytes",
+        name, (uint32_t)peakMessages, (unsigned long long)peakBytes, maxMessages, (unsigned long long)maxBytes);
+}
+
+bool OpenWakeup(sys_common_t *sys)
+{
+    return sys->wakeup.open();
+}
+
+void WakeupReader(sys_common_t *sys)
+{
+    sys->wakeup.signal();
 }
 
 uint32_t HTSPNextSeqNum(sys_common_t *sys)
@@ -41,161 +285,524 @@ uint32_t HTSPNextSeqNum(sys_common_t *sys)
     return res;
 }
 
-bool TransmitMessageEx(vlc_object_t *obj, sys_common_t *sys, HtsMessage m)
+// Sends every finished frame in txBuffer with a single write
+static bool FlushTransmit(vlc_object_t *obj, sys_common_t *sys)
 {
-    if(sys->netfd < 0)
+    uint32_t len = sys->txBuffer.getCommitted();
+    if(len == 0)
+        return true;
+
+    sys->midFrame = true;
+    bool res = net_Write(obj, sys->netfd, NULL, sys->txBuffer.getData(), len) == (ssize_t)len;
+    sys->txBuffer.clear();
+
+    if(!res)
     {
-        msg_Dbg(obj, "Invalid netfd in TransmitMessage");
+        msg_Dbg(obj, "net_Write failed");
         return false;
     }
 
-    void *buf;
-    uint32_t len;
+    sys->midFrame = false;
+    return true;
+}
+
+void CorkTransmit(sys_common_t *sys)
+{
+    sys->txCork++;
+}
+
+bool UncorkTransmitEx(vlc_object_t *obj, sys_common_t *sys)
+{
+    if(--sys->txCork > 0)
+        return true;
 
-    if(!m.Serialize(&len, &buf))
+    if(sys->netfd < 0)
     {
-        msg_Dbg(obj, "Serialising message failed");
+        sys->txBuffer.clear();
         return false;
     }
 
-    if(net_Write(obj, sys->netfd, NULL, buf, len) != (ssize_t)len)
+    return FlushTransmit(obj, sys);
+}
+
+bool TransmitMessageEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &m)
+{
+    if(sys->netfd < 0)
     {
-        msg_Dbg(obj, "net_Write failed");
+        msg_Dbg(obj, "Invalid netfd in TransmitMessage");
         return false;
     }
 
-    free(buf);
+    m.finish();
 
-    return true;
+    if(sys->txCork > 0)
+        return true;
+
+    return FlushTransmit(obj, sys);
 }
 
-HtsMessage ReadMessageEx(vlc_object_t *obj, sys_common_t *sys)
+static void DropConnection(sys_common_t *sys)
 {
-    char *buf;
-    uint32_t len;
-    ssize_t readSize;
+    net_Close(sys->netfd);
+    sys->netfd = -1;
+    sys->rxStart = sys->rxEnd = 0;
+    sys->midFrame = false;
+}
+
+static void ReadFailed(vlc_object_t *obj, sys_common_t *sys, ssize_t readSize)
+{
+    DropConnection(sys);
+
+    if(readSize == 0)
+        msg_Err(obj, "Data Read EOF!");
+    else if(readSize < 0)
+        msg_Err(obj, "Data Read ERROR!");
+    else
+        msg_Err(obj, "Error reading data: %m");
+}
 
-    if(sys->queue.size())
+// A peer that went away without closing the connection is only noticed by
+// TCP after many minutes, the server sends status messages every second.
+// With woken given, a WakeupReader() call also ends the wait.
+static bool WaitReceive(vlc_object_t *obj, sys_common_t *sys, bool *woken = 0)
+{
+    bool wakeable = woken && sys->wakeup.getFd() >= 0;
+    if(sys->readTimeout <= 0 && !wakeable)
+        return true;
+
+    struct pollfd ufd[2];
+    ufd[0].fd = sys->netfd;
+    ufd[0].events = POLLIN;
+    ufd[1].fd = sys->wakeup.getFd();
+    ufd[1].events = POLLIN;
+
+    int res = Poll(ufd, wakeable ? 2 : 1, sys->readTimeout > 0 ? sys->readTimeout * 1000 : -1);
+    if(res > 0)
     {
-        HtsMessage res = sys->queue.front();
-        sys->queue.pop_front();
-        return res;
+        if(wakeable && ufd[1].revents)
+        {
+            sys->wakeup.clear();
+            *woken = true;
+        }
+        return true;
     }
 
-    if(sys->netfd < 0)
+    DropConnection(sys);
+
+    if(res == 0)
+        msg_Err(obj, "No data for %d seconds, connection stalled", sys->readTimeout);
+    else
+        msg_Err(obj, "Error waiting for data: %m");
+
+    return false;
+}
+
+// Reads what the socket has, up to len bytes. The socket is only waited on,
+// with the stall timeout, when there is nothing to read right away, so a
+// connection that keeps up costs a single call per read. Returns 0 once
+// the connection was dropped.
+static ssize_t Receive(vlc_object_t *obj, sys_common_t *sys, void *buf, size_t len)
+{
+    if(sys->readTimeout > 0)
     {
-        msg_Dbg(obj, "ReadMessage on closed netfd");
-        return HtsMessage();
+#ifdef _WIN32
+        // VLC's sockets don't block
+        ssize_t readSize = recv(sys->netfd, (char*)buf, len, 0);
+        bool empty = readSize < 0 && net_errno == WSAEWOULDBLOCK;
+#else
+        ssize_t readSize = recv(sys->netfd, buf, len, MSG_DONTWAIT);
+        bool empty = readSize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+#endif
+        if(readSize > 0)
+            return readSize;
+
+        if(!empty)
+        {
+            ReadFailed(obj, sys, readSize);
+            return 0;
+        }
+
+        if(!WaitReceive(obj, sys))
+            return 0;
     }
 
-    if((readSize = net_Read(obj, sys->netfd, NULL, &len, sizeof(len), true)) != sizeof(len))
+    ssize_t readSize = net_Read(obj, sys->netfd, NULL, buf, len, false);
+    if(readSize <= 0)
     {
-        net_Close(sys->netfd);
-        sys->netfd = -1;
+        ReadFailed(obj, sys, readSize);
+        return 0;
+    }
+    return readSize;
+}
+
+// Reads whatever the socket has, up to the free space in the receive buffer.
+// The bytes not consumed yet are moved to the front first; there are never
+// more than RX_DIRECT_SIZE of them when this is called.
+static bool FillReceiveBuffer(vlc_object_t *obj, sys_common_t *sys)
+{
+    if(sys->rxStart > 0)
+    {
+        memmove(sys->rxBuffer, sys->rxBuffer + sys->rxStart, sys->rxEnd - sys->rxStart);
+        sys->rxEnd -= sys->rxStart;
+        sys->rxStart = 0;
+    }
+
+    ssize_t readSize = Receive(obj, sys, sys->rxBuffer + sys->rxEnd, RX_BUFFER_SIZE - sys->rxEnd);
+    if(readSize == 0)
+        return false;
+
+    sys->rxEnd += readSize;
+    return true;
+}
+
+static uint32_t TakeReceived(sys_common_t *sys, uint32_t max, const unsigned char **data)
+{
+    uint32_t size = sys->rxEnd - sys->rxStart;
+    if(size > max)
+        size = max;
+
+    *data = sys->rxBuffer + sys->rxStart;
+    sys->rxStart += size;
+    return size;
+}
+
+bool WaitMessageEx(vlc_object_t *obj, sys_common_t *sys, bool receive)
+{
+    if(!receive)
+    {
+        sys->wakeup.wait(-1);
+        return false;
+    }
+
+    // Whatever is buffered already is read without waiting
+    if(!sys->queue.empty() || sys->rxStart < sys->rxEnd || sys->netfd < 0)
+        return true;
 
-        if(readSize == 0)
+    bool woken = false;
+    WaitReceive(obj, sys, &woken);
+    return !woken;
+}
+
+// Waits until at least size bytes are buffered
+static bool BufferReceived(vlc_object_t *obj, sys_common_t *sys, uint32_t size)
+{
+    while(sys->rxEnd - sys->rxStart < size)
+        if(!FillReceiveBuffer(obj, sys))
+            return false;
+    return true;
+}
+
+// The seq of a reply only comes at the end of the frame, replies to
+// streamed requests are told apart by the list they start with instead
+static bool FindStreamed(vlc_object_t *obj, sys_common_t *sys, uint32_t len, HtsStreamParser **parser)
+{
+    *parser = 0;
+    if(sys->streamed.empty() || len < 6)
+        return true;
+
+    if(!BufferReceived(obj, sys, 6))
+        return false;
+
+    uint32_t header = 6 + sys->rxBuffer[sys->rxStart + 1];
+    if(header > len)
+        return true;
+
+    if(!BufferReceived(obj, sys, header))
+        return false;
+
+    for(auto it = sys->streamed.begin(); it != sys->streamed.end(); ++it)
+    {
+        if(it->second->matches(sys->rxBuffer + sys->rxStart, header))
         {
-            msg_Err(obj, "Size Read EOF!");
-            return HtsMessage();
+            *parser = it->second;
+            break;
         }
-        else if(readSize < 0)
-        {
-            msg_Err(obj, "Data Read ERROR!");
+    }
+    return true;
+}
+
+static HtsMessage ReadStreamedMessage(vlc_object_t *obj, sys_common_t *sys, uint32_t len, HtsStreamParser *parser)
+{
+    parser->begin(len);
+    while(len > 0)
+    {
+        if(sys->rxStart == sys->rxEnd && !FillReceiveBuffer(obj, sys))
             return HtsMessage();
-        }
 
-        msg_Err(obj, "Error reading size: %m");
+        const unsigned char *data;
+        uint32_t size = TakeReceived(sys, len, &data);
+
+        // A malformed frame is still read to the end, finish() then fails
+        parser->feed(data, size);
+        len -= size;
+    }
+
+    return parser->finish();
+}
+
+// The next message, either queued or from the socket
+static HtsMessage ReadFrame(vlc_object_t *obj, sys_common_t *sys, HtsStreamParser *parser)
+{
+    unsigned char *buf;
+    uint32_t len;
+    const unsigned char *data;
+
+    if(!sys->queue.empty())
+        return sys->queue.pop();
+
+    if(sys->netfd < 0)
+    {
+        msg_Dbg(obj, "ReadMessage on closed netfd");
         return HtsMessage();
     }
 
+    if(!BufferReceived(obj, sys, sizeof(len)))
+        return HtsMessage();
+
+    TakeReceived(sys, sizeof(len), &data);
+    memcpy(&len, data, sizeof(len));
+
     len = ntohl(len);
     if(len == 0)
         return HtsMessage();
 
-    buf = (char*)malloc(len);
+    sys->midFrame = true;
+
+    if(!parser && !FindStreamed(obj, sys, len, &parser))
+        return HtsMessage();
 
-    if((readSize = net_Read(obj, sys->netfd, NULL, buf, len, true)) != (ssize_t)len)
+    if(parser)
     {
-        net_Close(sys->netfd);
-        sys->netfd = -1;
+        HtsMessage res = ReadStreamedMessage(obj, sys, len, parser);
+        sys->midFrame = false;
+        return res;
+    }
+
+    // The buffer keeps the arena alive from here on
+    HtsArena *arena = sys->arenas->acquire();
+    HtsBuffer owner = arena->allocateBuffer(len);
+    arena->release();
+    buf = (unsigned char*)owner.get();
 
-        if(readSize == 0)
+    uint32_t done = TakeReceived(sys, len, &data);
+    memcpy(buf, data, done);
+
+    while(done < len)
+    {
+        // Large remainders go straight into the message, small ones are
+        // read together with whatever follows them
+        if(len - done >= RX_DIRECT_SIZE)
         {
-            msg_Err(obj, "Data Read EOF!");
-            return HtsMessage();
+            ssize_t readSize = Receive(obj, sys, buf + done, len - done);
+            if(readSize == 0)
+                return HtsMessage();
+            done += readSize;
+            continue;
         }
-        else if(readSize < 0)
-        {
-            msg_Err(obj, "Data Read ERROR!");
+
+        if(!FillReceiveBuffer(obj, sys))
             return HtsMessage();
-        }
 
-        msg_Err(obj, "Error reading data: %m");
-        return HtsMessage();
+        uint32_t size = TakeReceived(sys, len - done, &data);
+        memcpy(buf + done, data, size);
+        done += size;
     }
 
-    HtsMessage result = HtsMessage::Deserialize(len, buf);
-    free(buf);
-    return result;
+    sys->midFrame = false;
+    return HtsMessage::Wrap(len, std::move(owner), arena);
 }
 
-HtsMessage ReadResultEx(vlc_object_t *obj, sys_common_t *sys, HtsMessage m, bool sequence)
+static bool GetSequence(HtsMessage &m, uint32_t *seq)
 {
-    uint32_t iSequence = 0;
-    if(sequence)
+    HtsMessageHeader header;
+    HtsDecode(m, header);
+    *seq = header.seq;
+    return header.has(HtsMessageHeader::FIELD_seq);
+}
+
+static bool MatchSequence(HtsMessage &m, uint32_t seq)
+{
+    uint32_t res;
+    return GetSequence(m, &res) && res == seq;
+}
+
+// Replies carrying an error are handed to the callbacks as invalid messages
+static bool CheckReplyMessage(vlc_object_t *obj, HtsMessage &m)
+{
+    // Replies are read through the generic tree, which also checks the frame
+    if(m.isValid())
+        m.getRoot();
+
+    if(!m.isValid())
     {
-        iSequence = HTSPNextSeqNum(sys);
-        m.getRoot()->setData("seq", iSequence);
+        msg_Err(obj, "ReadMessage failed!");
+        return false;
     }
 
-    if(!TransmitMessageEx(obj, sys, m))
+    if(m.getRoot()->contains(HtsKeys::error))
     {
-        msg_Err(obj, "TransmitMessage failed!");
-        return HtsMessage();
+        msg_Err(obj, "HTSP Error: %s", m.getRoot()->getStr(HtsKeys::error).c_str());
+        return false;
     }
+    if(m.getRoot()->getU32(HtsKeys::noaccess) != 0)
+    {
+        msg_Err(obj, "Access Denied");
+        return false;
+    }
+
+    return true;
+}
 
-    std::deque<HtsMessage> queue;
-    sys->queue.swap(queue);
+// Completes the pending request the message is the reply to, if any
+static bool DispatchReply(vlc_object_t *obj, sys_common_t *sys, HtsMessage &m)
+{
+    uint32_t seq;
+    if(!GetSequence(m, &seq))
+        return false;
+
+    auto it = sys->pending.find(seq);
+    if(it == sys->pending.end())
+        return false;
+
+    reply_callback_t callback = std::move(it->second);
+    sys->pending.erase(it);
+    sys->streamed.erase(seq);
 
-    while((m = ReadMessageEx(obj, sys)).isValid())
+    if(!CheckReplyMessage(obj, m))
+        m = HtsMessage();
+    callback(m);
+    return true;
+}
+
+static void FailPending(sys_common_t *sys)
+{
+    std::unordered_map<uint32_t, reply_callback_t> pending;
+    pending.swap(sys->pending);
+    sys->streamed.clear();
+
+    for(auto it = pending.begin(); it != pending.end(); ++it)
     {
-        if(!sequence)
-            break;
-        if(m.getRoot()->contains("seq") && m.getRoot()->getU32("seq") == iSequence)
-            break;
+        HtsMessage none;
+        it->second(none);
+    }
+}
+
+HtsMessage ReadMessageEx(vlc_object_t *obj, sys_common_t *sys, HtsStreamParser *parser)
+{
+    for(;;)
+    {
+        HtsMessage m = ReadFrame(obj, sys, parser);
+        if(sys->pending.empty())
+            return m;
 
-        queue.push_back(m);
-        if(queue.size() >= MAX_QUEUE_SIZE)
+        if(!m.isValid())
         {
-            msg_Err(obj, "Max queue size reached!");
-            sys->queue.swap(queue);
-            return HtsMessage();
+            if(sys->netfd < 0)
+                FailPending(sys);
+            return m;
         }
+
+        if(!DispatchReply(obj, sys, m))
+            return m;
     }
+}
 
-    sys->queue.swap(queue);
+uint32_t SendRequestEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &req)
+{
+    uint32_t iSequence = HTSPNextSeqNum(sys);
+    req.setData(HtsKeys::seq, iSequence);
 
-    if(!m.isValid())
+    if(!TransmitMessageEx(obj, sys, req))
     {
-        msg_Err(obj, "ReadMessage failed!");
+        msg_Err(obj, "TransmitMessage failed!");
+        return 0;
+    }
+
+    return iSequence;
+}
+
+HtsMessage ReadReplyEx(vlc_object_t *obj, sys_common_t *sys, uint32_t iSequence, HtsStreamParser *parser)
+{
+    // Nothing will answer a request that is still corked
+    if(sys->txBuffer.getCommitted() > 0 && !FlushTransmit(obj, sys))
         return HtsMessage();
+
+    HtsMessage m;
+
+    // With several requests in flight the reply may have been queued
+    // while waiting for an earlier one
+    for(auto it = sys->queue.begin(); iSequence != 0 && it != sys->queue.end(); ++it)
+    {
+        if(MatchSequence(*it, iSequence))
+        {
+            m = sys->queue.take(it);
+            break;
+        }
     }
 
-    if(m.getRoot()->contains("error"))
+    if(!m.isValid())
     {
-        msg_Err(obj, "HTSP Error: %s", m.getRoot()->getStr("error").c_str());
+        // Moved aside with its budget, so that the next messages come from
+        // the socket. Nothing can be left unread while waiting for the
+        // reply, a full queue fails the request.
+        MessageQueue queue;
+        sys->queue.swap(queue);
+
+        while((m = ReadMessageEx(obj, sys, parser)).isValid())
+        {
+            if(iSequence == 0)
+                break;
+            if(MatchSequence(m, iSequence))
+                break;
+
+            queue.push(std::move(m));
+            if(queue.full())
+            {
+                msg_Err(obj, "Max queue size reached!");
+                sys->queue.swap(queue);
+                return HtsMessage();
+            }
+        }
+
+        sys->queue.swap(queue);
+    }
+
+    if(!CheckReplyMessage(obj, m))
         return HtsMessage();
+
+    return m;
+}
+
+uint32_t SendRequestAsyncEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &req, const reply_callback_t &callback, HtsStreamParser *parser)
+{
+    uint32_t iSequence = SendRequestEx(obj, sys, req);
+    if(iSequence != 0)
+    {
+        sys->pending[iSequence] = callback;
+        if(parser)
+            sys->streamed[iSequence] = parser;
     }
-    if(m.getRoot()->getU32("noaccess") != 0)
+    return iSequence;
+}
+
+HtsMessage ReadResultEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &req, bool sequence, HtsStreamParser *parser)
+{
+    uint32_t iSequence = 0;
+    if(sequence)
     {
-        msg_Err(obj, "Access Denied");
+        if((iSequence = SendRequestEx(obj, sys, req)) == 0)
+            return HtsMessage();
+    }
+    else if(!TransmitMessageEx(obj, sys, req))
+    {
+        msg_Err(obj, "TransmitMessage failed!");
         return HtsMessage();
     }
 
-    return m;
+    return ReadReplyEx(obj, sys, iSequence, parser);
 }
 
-bool ReadSuccessEx(vlc_object_t *obj, sys_common_t *sys, HtsMessage m, const std::string &action, bool sequence)
+bool ReadSuccessEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &m, const std::string &action, bool sequence)
 {
     if(!ReadResultEx(obj, sys, m, sequence).isValid())
     {
@@ -204,3 +811,200 @@ bool ReadSuccessEx(vlc_object_t *obj, sys_common_t *sys, HtsMessage m, const std
     }
     return true;
 }
+
+bool DrainToReplyEx(vlc_object_t *obj, sys_common_t *sys, uint32_t seq)
+{
+    // Whatever was cut off halfway can't be read past
+    if(sys->netfd < 0 || sys->midFrame)
+        return false;
+
+    if(sys->txBuffer.getCommitted() > 0 && !FlushTransmit(obj, sys))
+        return false;
+
+    sys->queue.clear();
+    FailPending(sys);
+
+    for(;;)
+    {
+        HtsMessage m = ReadFrame(obj, sys, 0);
+        if(!m.isValid())
+            break;
+        if(MatchSequence(m, seq))
+            return true;
+    }
+
+    if(sys->netfd >= 0)
+    {
+        msg_Dbg(obj, "No reply to %u, closing the connection", seq);
+        DropConnection(sys);
+    }
+    return false;
+}
+
+/* Idle sessions are kept in a plain list, there are never more than a
+ * handful of them. */
+struct idle_session_t
+{
+    std::string host;
+    uint16_t port;
+    std::string user;
+    std::string password;
+
+    int netfd;
+    unsigned char *rxBuffer;
+    uint32_t rxStart;
+    uint32_t rxEnd;
+    uint32_t nextSeqNum;
+    uint32_t nextSubscriptionId;
+    std::string serverName;
+    std::string serverVersion;
+    int32_t protoVersion;
+    mtime_t since;
+};
+
+static vlc_mutex_t sessionLock = VLC_STATIC_MUTEX;
+static std::list<idle_session_t> idleSessions;
+
+static void CloseIdleSession(idle_session_t &session)
+{
+    net_Close(session.netfd);
+    delete[] session.rxBuffer;
+}
+
+// Closes what is still idle when the module is unloaded. Defined after
+// idleSessions, so that it is destroyed first.
+static struct idle_sessions_cleanup_t
+{
+    ~idle_sessions_cleanup_t()
+    {
+        for(auto it = idleSessions.begin(); it != idleSessions.end(); ++it)
+            CloseIdleSession(*it);
+        idleSessions.clear();
+    }
+} idleSessionsCleanup;
+
+// A connection the server has closed meanwhile reads as EOF
+static bool IsSessionAlive(int fd)
+{
+    struct pollfd ufd;
+    ufd.fd = fd;
+    ufd.events = POLLIN;
+
+    int res = Poll(&ufd, 1, 0);
+    if(res == 0)
+        return true;
+    if(res < 0 || (ufd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+        return false;
+
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK) > 0;
+}
+
+// Called with sessionLock held
+static void ExpireIdleSessions(mtime_t now)
+{
+    for(auto it = idleSessions.begin(); it != idleSessions.end();)
+    {
+        if(now - it->since > SESSION_IDLE_TIMEOUT * CLOCK_FREQ || !IsSessionAlive(it->netfd))
+        {
+            CloseIdleSession(*it);
+            it = idleSessions.erase(it);
+            continue;
+        }
+        ++it;
+    }
+}
+
+bool AcquireSessionEx(vlc_object_t *obj, sys_common_t *sys, const std::string &host, uint16_t port, const std::string &user, const std::string &password)
+{
+    if(sys->netfd >= 0)
+        return false;
+
+    bool found = false;
+
+    vlc_mutex_lock(&sessionLock);
+    ExpireIdleSessions(mdate());
+    for(auto it = idleSessions.begin(); it != idleSessions.end(); ++it)
+    {
+        if(it->host == host && it->port == port && it->user == user && it->password == password)
+        {
+            sys->netfd = it->netfd;
+            std::swap(sys->rxBuffer, it->rxBuffer);
+            sys->rxStart = it->rxStart;
+            sys->rxEnd = it->rxEnd;
+            sys->nextSeqNum = it->nextSeqNum;
+            sys->nextSubscriptionId = it->nextSubscriptionId;
+            sys->serverName = it->serverName;
+            sys->serverVersion = it->serverVersion;
+            sys->protoVersion = it->protoVersion;
+
+            delete[] it->rxBuffer;
+            idleSessions.erase(it);
+            found = true;
+            break;
+        }
+    }
+    vlc_mutex_unlock(&sessionLock);
+
+    if(found)
+        msg_Dbg(obj, "Reusing idle session to %s:%u", host.c_str(), port);
+
+    return found;
+}
+
+void ReleaseSessionEx(vlc_object_t *obj, sys_common_t *sys, const std::string &host, uint16_t port, const std::string &user, const std::string &password)
+{
+    if(sys->netfd < 0)
+        return;
+
+    // Messages already queued and replies still due belong to the old owner,
+    // whose callbacks learn here that their request failed. Later ones are
+    // told apart by their seq and subscriptionId, which keep counting up on
+    // the session.
+    sys->queue.clear();
+    FailPending(sys);
+    sys->txBuffer.clear();
+    sys->txCork = 0;
+
+    // A read or write that was cancelled halfway leaves the stream unusable
+    if(sys->midFrame)
+    {
+        net_Close(sys->netfd);
+        sys->netfd = -1;
+        sys->rxStart = sys->rxEnd = 0;
+        sys->midFrame = false;
+        return;
+    }
+
+    idle_session_t session;
+    session.host = host;
+    session.port = port;
+    session.user = user;
+    session.password = password;
+    session.netfd = sys->netfd;
+    session.rxBuffer = sys->rxBuffer;
+    session.rxStart = sys->rxStart;
+    session.rxEnd = sys->rxEnd;
+    session.nextSeqNum = sys->nextSeqNum;
+    session.nextSubscriptionId = sys->nextSubscriptionId;
+    session.serverName = sys->serverName;
+    session.serverVersion = sys->serverVersion;
+    session.protoVersion = sys->protoVersion;
+    session.since = mdate();
+
+    sys->netfd = -1;
+    sys->rxBuffer = new unsigned char[RX_BUFFER_SIZE];
+    sys->rxStart = sys->rxEnd = 0;
+
+    vlc_mutex_lock(&sessionLock);
+    ExpireIdleSessions(session.since);
+    idleSessions.push_back(session);
+    if(idleSessions.size() > MAX_IDLE_SESSIONS)
+    {
+        CloseIdleSession(idleSessions.front());
+        idleSessions.pop_front();
+    }
+    vlc_mutex_unlock(&sessionLock);
+
+    msg_Dbg(obj, "Keeping idle session to %s:%u", host.c_str(), port);
+}
@@ -21,44 +21,386 @@
 
 #include <string>
 #include <deque>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
 
 #include "htsmessage.h"
 
 #include <vlc_common.h>
+#include <vlc_threads.h>
 
 
 #define CFG_PREFIX "htsp-"
 #define MAX_QUEUE_SIZE 1000
+#define MAX_QUEUE_BYTES (16 * 1024 * 1024)
+// Ranges of the options for the demuxer queue, batches and PCR
+#define QUEUE_SIZE_MIN 1024
+#define QUEUE_SIZE_MAX (1024 * 1024)
+#define QUEUE_MESSAGES_MIN 16
+#define QUEUE_MESSAGES_MAX 65536
+#define DEMUX_BATCH_MAX 1024
+#define DEMUX_BATCH_TIME_MAX 100000
+#define PCR_INTERVAL_MAX 1000000
+#define RX_BUFFER_SIZE 65536
+#define RX_DIRECT_SIZE 16384
 #define READ_TIMEOUT 10
+#define RECONNECT_ATTEMPTS 8
+#define RECONNECT_DELAY_MIN 1
+#define RECONNECT_DELAY_MAX 30
+#define SESSION_IDLE_TIMEOUT 30
+#define MAX_IDLE_SESSIONS 4
+#define HISTOGRAM_BUCKETS 24
 
 #define HTSP_PROTO_VERSION 19
 
 extern const char *const cfg_options[];
 
 class HtsMessage;
+
+/* Called on the reading thread with the reply to an asynchronous request,
+ * or with an invalid message if the request failed or the connection
+ * went away. */
+typedef std::function<void(HtsMessage &reply)> reply_callback_t;
+
+/* Power of two buckets of latencies or counts, dumped to the debug log.
+ * Not thread safe, samples are added by one thread. */
+class Histogram
+{
+    public:
+    Histogram();
+
+    void add(int64_t value);
+    void dump(vlc_object_t *obj, const char *name, const char *unit = "us") const;
+
+    private:
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint32_t count;
+    int64_t total;
+    int64_t max;
+};
+
+/* A queue of messages that keeps count of the bytes they hold. The budget
+ * is not enforced by the queue, the side that fills it checks full(). */
+class MessageQueue
+{
+    public:
+    typedef std::deque<HtsMessage>::iterator iterator;
+
+    MessageQueue();
+
+    void setBudget(uint32_t messages, uint64_t bytes);
+
+    bool empty() const { return messages.empty(); }
+    size_t size() const { return messages.size(); }
+    uint64_t getBytes() const { return bytes; }
+
+    bool full() const { return messages.size() >= maxMessages || bytes >= maxBytes; }
+    // Back under half the budget, for some hysteresis after full()
+    bool drained() const { return messages.size() <= maxMessages / 2 && bytes <= maxBytes / 2; }
+
+    iterator begin() { return messages.begin(); }
+    iterator end() { return messages.end(); }
+
+    void push(HtsMessage &&m);
+    HtsMessage pop();
+    HtsMessage take(iterator it);
+    void clear();
+    void swap(MessageQueue &other);
+
+    void dump(vlc_object_t *obj, const char *name) const;
+
+    private:
+    std::deque<HtsMessage> messages;
+    uint64_t bytes;
+
+    uint32_t maxMessages;
+    uint64_t maxBytes;
+
+    size_t peakMessages;
+    uint64_t peakBytes;
+};
+
+/* Notification from one thread to another that can be polled for together
+ * with a socket: an eventfd on Linux and a pipe elsewhere. Where neither
+ * can be polled for (Win32) open() returns false and getFd() -1, wait()
+ * then blocks on a condition variable instead. A signal is kept until it
+ * is waited for or cleared. */
+class Notify
+{
+    public:
+    Notify();
+    ~Notify();
+
+    bool open();
+    int getFd() const { return fd[0]; }
+
+    void signal();
+    void clear();
+    // Waits up to timeout for a signal and clears it, forever if negative
+    void wait(mtime_t timeout);
+
+    private:
+    Notify(const Notify &);
+    Notify &operator=(const Notify &);
+
+    int fd[2];
+
+    // Without fd
+    vlc_mutex_t lock;
+    vlc_cond_t cond;
+    bool signalled;
+};
+
+/* Bounded single producer, single consumer ring, without locks. T is
+ * movable, default constructible and tells its size with getLength(). The
+ * consumer sleeps in wait(), and is only notified when a push finds the
+ * ring empty. Budget and statistics as for MessageQueue; the statistics
+ * are kept by the producer. */
+template<class T>
+class MessageRing
+{
+    public:
+    MessageRing()
+        :slots(0)
+        ,mask(0)
+        ,head(0)
+        ,tail(0)
+        ,bytes(0)
+        ,maxMessages(0)
+        ,maxBytes(0)
+        ,peakMessages(0)
+        ,peakBytes(0)
+    {}
+
+    ~MessageRing()
+    {
+        delete[] slots;
+    }
+
+    void open(uint32_t messages, uint64_t bytes)
+    {
+        maxMessages = messages;
+        maxBytes = bytes;
+
+        // Reads stop at the budget, one more slot takes the end of stream
+        uint32_t size = 2;
+        while(size < messages + 1)
+            size *= 2;
+
+        slots = new T[size];
+        mask = size - 1;
+
+        // The consumer never waits together with a socket, the condition
+        // variable does just as well if this fails
+        notify.open();
+    }
+
+    // Producer
+    bool push(T &&m)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) > mask)
+            return false;
+
+        uint32_t length = m.getLength();
+        slots[h & mask] = std::move(m);
+        bytes += length;
+        head.store(h + 1);
+
+        // Pairs with the consumer storing tail before it checks for
+        // empty: either it sees this push or the ring is seen empty here
+        uint32_t t = tail.load();
+        if(t == h)
+            notify.signal();
+
+        if(h + 1 - t > peakMessages)
+            peakMessages = h + 1 - t;
+        if(bytes.load(std::memory_order_relaxed) > peakBytes)
+            peakBytes = bytes.load(std::memory_order_relaxed);
+
+        return true;
+    }
+
+    bool full() const
+    {
+        return head.load() - tail.load() >= maxMessages || bytes.load() >= maxBytes;
+    }
+
+    bool drained() const
+    {
+        return head.load() - tail.load() <= maxMessages / 2 && bytes.load() <= maxBytes / 2;
+    }
+
+    // Consumer
+    bool pop(T *m)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if(head.load(std::memory_order_acquire) == t)
+            return false;
+
+        *m = std::move(slots[t & mask]);
+        bytes -= m->getLength();
+        tail.store(t + 1);
+        return true;
+    }
+
+    bool empty() const { return head.load() == tail.load(); }
+
+    // Waits up to timeout for the ring to be non empty
+    bool wait(mtime_t timeout)
+    {
+        if(!empty())
+            return true;
+
+        notify.wait(timeout);
+        return !empty();
+    }
+
+    void dump(vlc_object_t *obj, const char *name) const
+    {
+        msg_Dbg(obj, "%s: peak %u messages, %llu bytes of %u messages, %llu bytes",
+            name, peakMessages, (unsigned long long)peakBytes, maxMessages, (unsigned long long)maxBytes);
+    }
+
+    private:
+    MessageRing(const MessageRing &);
+    MessageRing &operator=(const MessageRing &);
+
+    T *slots;
+    uint32_t mask;
+
+    // Padded apart, so that producer and consumer don't keep taking
+    // the same cache line from each other
+    std::atomic<uint32_t> head;
+    char headPad[64 - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint32_t> tail;
+    char tailPad[64 - sizeof(std::atomic<uint32_t>)];
+    std::atomic<uint64_t> bytes;
+
+    uint32_t maxMessages;
+    uint64_t maxBytes;
+
+    uint32_t peakMessages;
+    uint64_t peakBytes;
+
+    Notify notify;
+};
+
 struct sys_common_t
 {
     sys_common_t()
         :netfd(-1)
         ,nextSeqNum(1)
+        ,nextSubscriptionId(1)
+        ,protoVersion(0)
+        ,midFrame(false)
+        ,readTimeout(0)
+        ,arenas(HtsArenaPool::Create())
+        ,txCork(0)
+        ,rxBuffer(new unsigned char[RX_BUFFER_SIZE])
+        ,rxStart(0)
+        ,rxEnd(0)
     {}
 
     virtual ~sys_common_t();
 
     int netfd;
     uint32_t nextSeqNum;
-    std::deque<HtsMessage> queue;
+    uint32_t nextSubscriptionId;
+    // From the hello reply, kept with the session when it is reused
+    std::string serverName;
+    std::string serverVersion;
+    int32_t protoVersion;
+    bool midFrame;
+    // Seconds without any data before the connection is given up, 0 waits
+    // forever
+    int readTimeout;
+    // Messages read while waiting for a reply
+    MessageQueue queue;
+    std::unordered_map<uint32_t, reply_callback_t> pending;
+    // The pending requests whose reply goes through a parser as it is read
+    std::unordered_map<uint32_t, HtsStreamParser*> streamed;
+    HtsArenaPool *arenas;
+    HtsWriter txBuffer;
+    uint32_t txCork;
+
+    // Bytes read from netfd that have not been framed yet
+    unsigned char *rxBuffer;
+    uint32_t rxStart;
+    uint32_t rxEnd;
+
+    // Ends WaitMessage, see WakeupReader()
+    Notify wakeup;
 };
 
-bool TransmitMessageEx(vlc_object_t *obj, sys_common_t *sys, HtsMessage m);
-HtsMessage ReadMessageEx(vlc_object_t *obj, sys_common_t *sys);
-HtsMessage ReadResultEx(vlc_object_t *obj, sys_common_t *sys, HtsMessage m, bool sequence = true);
-bool ReadSuccessEx(vlc_object_t *obj, sys_common_t *sys, HtsMessage m, const std::string &action, bool sequence = true);
+/* Lets other threads interrupt WaitMessage on the reading thread. If
+ * OpenWakeup fails, WaitMessage only returns for data; WaitWakeup still
+ * works. */
+bool OpenWakeup(sys_common_t *sys);
+void WakeupReader(sys_common_t *sys);
+
+/* Waits for data from the server or a WakeupReader() call, with the same
+ * timeout as reads. Returns false when woken up; ReadMessage should be
+ * called otherwise, it then also reports a stalled connection. With
+ * receive false only a wakeup ends the wait, which leaves the data to TCP
+ * flow control. */
+bool WaitMessageEx(vlc_object_t *obj, sys_common_t *sys, bool receive = true);
+
+/* While corked, transmitted messages are gathered in txBuffer and go out
+ * together with a single write when the last UncorkTransmit() is called,
+ * or as soon as a reply is waited for. */
+void CorkTransmit(sys_common_t *sys);
+bool UncorkTransmitEx(vlc_object_t *obj, sys_common_t *sys);
+
+bool TransmitMessageEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &m);
+HtsMessage ReadMessageEx(vlc_object_t *obj, sys_common_t *sys, HtsStreamParser *parser = 0);
+HtsMessage ReadResultEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &m, bool sequence = true, HtsStreamParser *parser = 0);
+bool ReadSuccessEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &m, const std::string &action, bool sequence = true);
+
+/* Split request and reply, for sending several requests before waiting.
+ * SendRequest returns the sequence number to wait for, 0 on failure. */
+uint32_t SendRequestEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &m);
+HtsMessage ReadReplyEx(vlc_object_t *obj, sys_common_t *sys, uint32_t seq, HtsStreamParser *parser = 0);
+
+/* Sends a request without waiting for it. ReadMessage hands the reply to
+ * the callback as it comes in and never returns it to the caller, so the
+ * reading thread keeps delivering everything else meanwhile. With a
+ * parser, a reply that starts with the parser's list is streamed through
+ * it and the callback gets what finish() returns; the parser has to live
+ * until the callback was called. */
+uint32_t SendRequestAsyncEx(vlc_object_t *obj, sys_common_t *sys, HtsMessageBuilder &m, const reply_callback_t &callback, HtsStreamParser *parser = 0);
+
+/* Process wide registry of idle, authenticated connections, keyed by
+ * server and credentials. Closed demuxers hand their connection back
+ * instead of closing it, so the next open on the same server skips
+ * connecting and the handshake. Sessions are handed out to one owner at a
+ * time and dropped after SESSION_IDLE_TIMEOUT seconds. */
+bool AcquireSessionEx(vlc_object_t *obj, sys_common_t *sys, const std::string &host, uint16_t port, const std::string &user, const std::string &password);
+void ReleaseSessionEx(vlc_object_t *obj, sys_common_t *sys, const std::string &host, uint16_t port, const std::string &user, const std::string &password);
+
+/* Sends what is left to send and reads up to the reply to seq, dropping
+ * everything before it along with the replies still due. Used before a
+ * session is released, so that the packets of a subscription that just
+ * ended don't pile up with the next owner. The connection is closed if
+ * the reply doesn't come. */
+bool DrainToReplyEx(vlc_object_t *obj, sys_common_t *sys, uint32_t seq);
 
+#define AcquireSession(a, b, c, d, e, f) AcquireSessionEx(VLC_OBJECT(a), b, c, d, e, f)
+#define ReleaseSession(a, b, c, d, e, f) ReleaseSessionEx(VLC_OBJECT(a), b, c, d, e, f)
+#define DrainToReply(a, b, c) DrainToReplyEx(VLC_OBJECT(a), b, c)
+#define WaitMessage(a, b) WaitMessageEx(VLC_OBJECT(a), b)
+#define WaitWakeup(a, b) WaitMessageEx(VLC_OBJECT(a), b, false)
+#define UncorkTransmit(a, b) UncorkTransmitEx(VLC_OBJECT(a), b)
 #define TransmitMessage(a, b, c) TransmitMessageEx(VLC_OBJECT(a), b, c)
 #define ReadMessage(a, b) ReadMessageEx(VLC_OBJECT(a), b)
 #define ReadResult(a, b, c) ReadResultEx(VLC_OBJECT(a), b, c)
+#define ReadResultStreamed(a, b, c, d) ReadResultEx(VLC_OBJECT(a), b, c, true, d)
 #define ReadSuccess(a, b, c, d) ReadSuccessEx(VLC_OBJECT(a), b, c, d)
+#define SendRequest(a, b, c) SendRequestEx(VLC_OBJECT(a), b, c)
+#define ReadReply(a, b, c) ReadReplyEx(VLC_OBJECT(a), b, c)
+#define SendRequestAsync(a, b, c, d) SendRequestAsyncEx(VLC_OBJECT(a), b, c, d)
+#define SendRequestAsyncStreamed(a, b, c, d, e) SendRequestAsyncEx(VLC_OBJECT(a), b, c, d, e)
 
 #define CHECK_VLC_VERSION(major, minor) \
         (VLC_PLUGIN_MAJOR > (major) || \
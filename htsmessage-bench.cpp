@@ -0,0 +1,507 @@
+/*****************************************************************************
+ * Copyright (C) 2012
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Microbenchmark for the HTSMSG codec. It needs neither VLC nor a server:
+ * the corpus is generated in memory and every message goes through the
+ * same steps as in the plugin (encode into a reused writer, read into a
+ * pooled arena and decode, walk the fields the plugin looks at).
+ *
+ * Usage: htsmessage-bench [seconds per case] */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "htsmessage.h"
+#include "htsschema.h"
+
+static std::atomic<uint64_t> newCalls(0);
+
+void *operator new(size_t size)
+{
+    newCalls++;
+    void *res = malloc(size ? size : 1);
+    if(!res)
+        throw std::bad_alloc();
+    return res;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+/* Both operator new and the chunks the arenas malloc themselves */
+static uint64_t allocations()
+{
+    return newCalls + HtsArena::getHeapAllocations();
+}
+
+#define STR(w, name, value) (w).writeStr(name, sizeof(name) - 1, value, strlen(value))
+#define S64(w, name, value) (w).writeS64(name, sizeof(name) - 1, value)
+
+/* Every generator writes one complete frame, fields in the order tvheadend
+ * sends them */
+typedef void (*generator_t)(HtsWriter &w, uint32_t n);
+
+static void GenMuxPacket(HtsWriter &w, uint32_t n, uint32_t payloadLength)
+{
+    static std::vector<unsigned char> payload;
+    if(payload.size() < payloadLength)
+    {
+        payload.resize(payloadLength);
+        for(uint32_t i = 0; i < payloadLength; i++)
+            payload[i] = (unsigned char)(i * 31);
+    }
+
+    HtsMessageBuilder m(w);
+    m.setData(HtsKeys::method, "muxpkt");
+    m.setData(HtsKeys::subscriptionId, 1);
+    m.setData(HtsKeys::frametype, n % 12 ? 'P' : 'I');
+    m.setData(HtsKeys::stream, 1 + n % 3);
+    m.setData(HtsKeys::dts, (int64_t)(n * 40000));
+    m.setData(HtsKeys::pts, (int64_t)(n * 40000 + 80000));
+    m.setData(HtsKeys::duration, 40000);
+    m.setData(HtsKeys::payload, &payload[0], payloadLength);
+    m.finish();
+}
+
+static void GenSmallMuxPacket(HtsWriter &w, uint32_t n)
+{
+    // One AAC frame
+    GenMuxPacket(w, n, 384);
+}
+
+static void GenUhdMuxPacket(HtsWriter &w, uint32_t n)
+{
+    // A 2160p HEVC reference frame
+    GenMuxPacket(w, n, 512 * 1024);
+}
+
+static void GenSubscriptionStart(HtsWriter &w, uint32_t)
+{
+    static const char *const types[] = { "HEVC", "AAC", "AC3", "DVBSUB", "TELETEXT" };
+    static const char *const langs[] = { "eng", "deu", "fra", "spa", "ita" };
+
+    w.beginFrame();
+    STR(w, "method", "subscriptionStart");
+    S64(w, "subscriptionId", 1);
+
+    uint32_t streams = w.beginList("streams", 7);
+    for(uint32_t i = 0; i < 20; i++)
+    {
+        uint32_t stream = w.beginMap("", 0);
+        S64(w, "index", i + 1);
+        STR(w, "type", types[i % 5]);
+        if(i % 5 == 0)
+        {
+            S64(w, "width", 3840);
+            S64(w, "height", 2160);
+            S64(w, "aspect_num", 16);
+            S64(w, "aspect_den", 9);
+        }
+        else
+        {
+            STR(w, "language", langs[i % 5]);
+            if(i % 5 < 3)
+            {
+                S64(w, "channels", 6);
+                S64(w, "rate", 48000);
+            }
+            else
+            {
+                S64(w, "composition_id", i);
+                S64(w, "ancillary_id", i);
+            }
+        }
+        w.endContainer(stream);
+    }
+    w.endContainer(streams);
+
+    uint32_t sourceinfo = w.beginMap("sourceinfo", 10);
+    STR(w, "adapter", "DVB-S #0");
+    STR(w, "mux", "11493H");
+    STR(w, "network", "Astra 19.2E");
+    STR(w, "provider", "ARD");
+    STR(w, "service", "Das Erste HD");
+    w.endContainer(sourceinfo);
+
+    w.endFrame();
+}
+
+static void GenGetEvents(HtsWriter &w, uint32_t)
+{
+    w.beginFrame();
+
+    uint32_t events = w.beginList("events", 6);
+    for(uint32_t i = 0; i < 5000; i++)
+    {
+        char title[64];
+        snprintf(title, sizeof(title), "Programme %u", i);
+
+        uint32_t event = w.beginMap("", 0);
+        S64(w, "eventId", 100000 + i);
+        S64(w, "channelId", 1 + i % 50);
+        S64(w, "start", 1400000000 + i * 1800);
+        S64(w, "stop", 1400000000 + (i + 1) * 1800);
+        STR(w, "title", title);
+        STR(w, "summary", "A short summary of what this programme is about.");
+        STR(w, "description", "A much longer description of the programme, written by the broadcaster, that goes on for a while and names the cast, the crew and the place it was filmed in.");
+        S64(w, "contentType", 16 + i % 8);
+        S64(w, "nextEventId", 100001 + i);
+        w.endContainer(event);
+    }
+    w.endContainer(events);
+
+    S64(w, "seq", 7);
+    w.endFrame();
+}
+
+static void GenChannelAdd(HtsWriter &w, uint32_t n)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "Channel %u HD", n);
+
+    w.beginFrame();
+    STR(w, "method", "channelAdd");
+    S64(w, "channelId", n + 1);
+    S64(w, "channelNumber", n + 1);
+    STR(w, "channelName", name);
+    STR(w, "channelIcon", "imagecache/1234");
+    S64(w, "eventId", 100000 + n);
+    S64(w, "nextEventId", 200000 + n);
+
+    uint32_t tags = w.beginList("tags", 4);
+    S64(w, "", 1);
+    S64(w, "", 2 + n % 4);
+    w.endContainer(tags);
+
+    uint32_t services = w.beginList("services", 8);
+    uint32_t service = w.beginMap("", 0);
+    STR(w, "name", "DVB-S #0/11493H/Channel");
+    STR(w, "type", "HDTV");
+    w.endContainer(service);
+    w.endContainer(services);
+
+    w.endFrame();
+}
+
+#undef STR
+#undef S64
+
+/* Every consumer reads what the plugin reads for that message */
+typedef uint64_t (*consumer_t)(HtsMap &root);
+
+static uint64_t UseMuxPacket(HtsMap &root)
+{
+    const void *bin;
+    uint32_t binlen;
+    root.getBinView(HtsKeys::payload, &binlen, &bin);
+
+    uint64_t res = root.getU32(HtsKeys::stream) + binlen;
+    if(root.contains(HtsKeys::pts))
+        res += root.getS64(HtsKeys::pts);
+    if(root.contains(HtsKeys::dts))
+        res += root.getS64(HtsKeys::dts);
+    res += root.getS64(HtsKeys::duration);
+    res += root.getU32(HtsKeys::frametype);
+    return res;
+}
+
+static uint64_t UseSubscriptionStart(HtsMap &root)
+{
+    uint64_t res = root.getMap(HtsKeys::sourceinfo).getStr(HtsKeys::service).length();
+
+    HtsList streams = root.getList(HtsKeys::streams);
+    for(uint32_t i = 0; i < streams.count(); i++)
+    {
+        HtsData sub = streams.getData(i);
+        if(!sub.isMap())
+            continue;
+        HtsMap map(sub);
+
+        res += map.getStr(HtsKeys::type).length();
+        res += map.getU32(HtsKeys::index);
+        res += map.getU32(HtsKeys::width) + map.getU32(HtsKeys::height);
+        res += map.getU32(HtsKeys::channels) + map.getU32(HtsKeys::rate);
+        res += map.getStr(HtsKeys::language).length();
+    }
+    return res;
+}
+
+static uint64_t UseGetEvents(HtsMap &root)
+{
+    uint64_t res = 0;
+
+    HtsList events = root.getList(HtsKeys::events);
+    for(uint32_t i = 0; i < events.count(); i++)
+    {
+        HtsData tmp = events.getData(i);
+        if(!tmp.isMap())
+            continue;
+        HtsMap event(tmp);
+
+        res += event.getU32(HtsKeys::channelId);
+        res += event.getS64(HtsKeys::stop) - event.getS64(HtsKeys::start);
+        res += event.getStr(HtsKeys::title).length();
+        res += event.getStr(HtsKeys::summary).length();
+        res += event.getStr(HtsKeys::description).length();
+    }
+    return res;
+}
+
+static uint64_t UseChannelAdd(HtsMap &root)
+{
+    uint64_t res = root.getStrView(HtsKeys::method).length;
+    res += root.getU32(HtsKeys::channelId);
+    res += root.getStr(HtsKeys::channelName).length();
+    res += root.getU32(HtsKeys::channelNumber);
+    res += root.getStr(HtsKeys::channelIcon).length();
+    return res;
+}
+
+/* The same reads through the typed decoders, header first like DemuxHTSP */
+typedef uint64_t (*typed_consumer_t)(const void *buf, uint32_t length);
+
+static uint64_t DecodeMuxPacket(const void *buf, uint32_t length)
+{
+    HtsMessageHeader header;
+    HtsMuxPacket pkt;
+    if(!header.decode(buf, length) || !pkt.decode(buf, length))
+        return 0;
+
+    uint64_t res = header.method.length + pkt.stream + pkt.payload.length;
+    if(pkt.has(HtsMuxPacket::FIELD_pts))
+        res += pkt.pts;
+    if(pkt.has(HtsMuxPacket::FIELD_dts))
+        res += pkt.dts;
+    res += pkt.duration + pkt.frametype;
+    return res;
+}
+
+static uint64_t DecodeSubscriptionStart(const void *buf, uint32_t length)
+{
+    HtsMessageHeader header;
+    HtsSubscriptionStart start;
+    if(!header.decode(buf, length) || !start.decode(buf, length))
+        return 0;
+
+    uint64_t res = header.method.length + start.sourceinfo.service.length;
+    for(uint32_t i = 0; i < start.streams.size(); i++)
+    {
+        const HtsStreamInfo &info = start.streams[i];
+
+        res += info.type.length + info.index;
+        res += info.width + info.height;
+        res += info.channels + info.rate;
+        res += info.language.length;
+    }
+    return res;
+}
+
+struct bench_case_t
+{
+    const char *name;
+    generator_t generate;
+    consumer_t consume;
+    typed_consumer_t decodeTyped;
+    uint32_t messages;
+};
+
+static const bench_case_t cases[] =
+{
+    { "muxpkt (384 B)", GenSmallMuxPacket, UseMuxPacket, DecodeMuxPacket, 64 },
+    { "muxpkt (512 KiB)", GenUhdMuxPacket, UseMuxPacket, DecodeMuxPacket, 4 },
+    { "subscriptionStart", GenSubscriptionStart, UseSubscriptionStart, DecodeSubscriptionStart, 1 },
+    { "getEvents (5000)", GenGetEvents, UseGetEvents, 0, 1 },
+    { "channelAdd storm", GenChannelAdd, UseChannelAdd, 0, 2000 },
+};
+
+struct bench_result_t
+{
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t allocations;
+    double seconds;
+    uint64_t sink;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double Elapsed(const bench_clock::time_point &start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/* Throughput is only printed for encoding, which copies every byte of the
+ * frame. Decoding skips over binary fields and the lookups cost the same
+ * for any frame size, so those phases are reported per message only */
+static void Report(const char *name, const char *phase, const bench_result_t &r)
+{
+    char throughput[32] = "";
+    if(r.bytes > 0)
+        snprintf(throughput, sizeof(throughput), "%10.1f MB/s", r.bytes / r.seconds / 1e6);
+
+    printf("%-20s %-7s %12.1f ns/op %15s %8.2f allocs/op\n", name, phase,
+            r.seconds * 1e9 / r.messages,
+            throughput,
+            (double)r.allocations / r.messages);
+}
+
+static void RunCase(const bench_case_t &c, double duration)
+{
+    // Corpus: the length-less frame bodies as they come off the socket
+    std::vector<std::vector<unsigned char>> corpus(c.messages);
+    HtsWriter w;
+    for(uint32_t i = 0; i < c.messages; i++)
+    {
+        w.clear();
+        c.generate(w, i);
+        const unsigned char *frame = (const unsigned char*)w.getData();
+        corpus[i].assign(frame + 4, frame + w.getLength());
+    }
+
+    bench_result_t r;
+
+    // Encode: the message goes into a writer that is reused for every send
+    memset(&r, 0, sizeof(r));
+    uint64_t allocs = allocations();
+    bench_clock::time_point start = bench_clock::now();
+    do
+    {
+        for(uint32_t i = 0; i < c.messages; i++)
+        {
+            w.clear();
+            c.generate(w, i);
+            r.bytes += w.getLength();
+        }
+        r.messages += c.messages;
+    } while((r.seconds = Elapsed(start)) < duration);
+    r.allocations = allocations() - allocs;
+    Report(c.name, "encode", r);
+
+    HtsArenaPool *pool = HtsArenaPool::Create();
+
+    // Decode: the same steps as ReadMessage. The read is a memcpy into the
+    // pooled buffers, done before the clock starts; the allocations of the
+    // whole round trip are counted all the same
+    std::vector<HtsBuffer> owners(c.messages);
+    std::vector<HtsArena*> arenas(c.messages);
+    std::vector<HtsMessage> messages(c.messages);
+
+    memset(&r, 0, sizeof(r));
+    allocs = allocations();
+    start = bench_clock::now();
+    do
+    {
+        for(uint32_t i = 0; i < c.messages; i++)
+        {
+            uint32_t len = corpus[i].size();
+            arenas[i] = pool->acquire();
+            owners[i] = arenas[i]->allocateBuffer(len);
+            arenas[i]->release();
+            memcpy(owners[i].get(), &corpus[i][0], len);
+        }
+
+        bench_clock::time_point decodeStart = bench_clock::now();
+        for(uint32_t i = 0; i < c.messages; i++)
+        {
+            messages[i] = HtsMessage::Deserialize(corpus[i].size(), std::move(owners[i]), arenas[i]);
+            r.sink += messages[i].isValid();
+        }
+        r.seconds += Elapsed(decodeStart);
+
+        for(uint32_t i = 0; i < c.messages; i++)
+            messages[i] = HtsMessage();
+        r.messages += c.messages;
+    } while(Elapsed(start) < duration);
+    r.allocations = allocations() - allocs;
+    Report(c.name, "decode", r);
+
+    owners.clear();
+    messages.clear();
+
+    // Access: field lookups on messages that have been decoded up front
+    std::vector<HtsMessage> decoded(c.messages);
+    for(uint32_t i = 0; i < c.messages; i++)
+        decoded[i] = HtsMessage::Deserialize(corpus[i].size(), &corpus[i][0]);
+
+    memset(&r, 0, sizeof(r));
+    allocs = allocations();
+    start = bench_clock::now();
+    do
+    {
+        for(uint32_t i = 0; i < c.messages; i++)
+        {
+            r.sink += c.consume(*decoded[i].getRoot());
+        }
+        r.messages += c.messages;
+    } while((r.seconds = Elapsed(start)) < duration);
+    r.allocations = allocations() - allocs;
+    Report(c.name, "access", r);
+
+    if(r.sink == 0)
+        printf("%s: corpus did not decode\n", c.name);
+
+    // Typed: decode and read straight from the frame, no node table
+    if(c.decodeTyped)
+    {
+        memset(&r, 0, sizeof(r));
+        allocs = allocations();
+        start = bench_clock::now();
+        do
+        {
+            for(uint32_t i = 0; i < c.messages; i++)
+            {
+                r.sink += c.decodeTyped(&corpus[i][0], corpus[i].size());
+            }
+            r.messages += c.messages;
+        } while((r.seconds = Elapsed(start)) < duration);
+        r.allocations = allocations() - allocs;
+        Report(c.name, "typed", r);
+    }
+
+    decoded.clear();
+    pool->close();
+}
+
+int main(int argc, char **argv)
+{
+    double duration = 0.5;
+    if(argc > 1)
+        duration = atof(argv[1]);
+    if(duration <= 0)
+    {
+        fprintf(stderr, "Usage: %s [seconds per case]\n", argv[0]);
+        return 1;
+    }
+
+    for(uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        RunCase(cases[i], duration);
+
+    return 0;
+}
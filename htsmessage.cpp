@@ -18,608 +18,975 @@
 
 #define __STDC_CONSTANT_MACROS 1
 
-#include <vlc_common.h>
-#include <vlc_plugin.h>
-#include <vlc_network.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
 
 #include "htsmessage.h"
 
-enum
+static uint32_t readU32(const unsigned char *buf)
 {
-    O32_LITTLE_ENDIAN = 0x03020100ul,
-    O32_BIG_ENDIAN = 0x00010203ul,
-    O32_PDP_ENDIAN = 0x01000302ul
-};
-static const union { unsigned char bytes[4]; uint32_t value; } o32_host_order = { { 0, 1, 2, 3 } };
-
-int64_t endian64(int64_t v)
-{
-    if(o32_host_order.value == O32_BIG_ENDIAN)
-        return v;
-
-    int64_t res = 0;
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
 
-    char *vp = (char*)&v;
-    char *rp = (char*)&res;
+#define HTS_ARENA_CHUNK 4096
+#define HTS_ARENA_KEEP (256 * 1024)
+#define HTS_ARENA_ALIGN 16
+#define HTS_POOL_IDLE 8
 
-    rp[0] = vp[7];
-    rp[1] = vp[6];
-    rp[2] = vp[5];
-    rp[3] = vp[4];
-    rp[4] = vp[3];
-    rp[5] = vp[2];
-    rp[6] = vp[1];
-    rp[7] = vp[0];
+std::atomic<uint64_t> HtsArena::heapAllocations(0);
 
-    return res;
+HtsArena *HtsArena::Create(HtsArenaPool *pool)
+{
+    heapAllocations++;
+    return new HtsArena(pool);
 }
 
-const std::string emptyString = std::string();
+HtsArena::HtsArena(HtsArenaPool *pool)
+    :chunks(0)
+    ,cur(0)
+    ,end(0)
+    ,refs(1)
+    ,pool(pool)
+    ,nextFree(0)
+{}
 
-HtsMap::HtsMap(uint32_t /*length*/, void *buf)
+HtsArena::~HtsArena()
 {
-    char *tmpbuf = (char*)buf;
-
-    if(tmpbuf[0] != getType())
-        return;
-    tmpbuf += 1;
-
-    unsigned char nlen = (unsigned char)tmpbuf[0];
-    tmpbuf += 1;
-
-    int64_t mlen = ntohl(*((uint32_t*)tmpbuf));
-    tmpbuf += sizeof(uint32_t);
-
-    if(nlen > 0)
+    while(chunks)
     {
-        setName(std::string(tmpbuf, (size_t)nlen));
-        tmpbuf += nlen;
+        Chunk *next = chunks->next;
+        free(chunks);
+        chunks = next;
     }
+}
+
+void *HtsArena::allocate(size_t size)
+{
+    size = (size + HTS_ARENA_ALIGN - 1) & ~(size_t)(HTS_ARENA_ALIGN - 1);
 
-    while(mlen > 0)
+    if((size_t)(end - cur) < size)
     {
-        unsigned char mtype = (unsigned char)tmpbuf[0];
-        unsigned char subNameLen = (unsigned char)tmpbuf[1];
-        uint32_t subLen = ntohl(*((uint32_t*)(tmpbuf+2)));
+        // Leave room behind large buffers for the index that follows them
+        size_t chunkSize = HTS_ARENA_ALIGN + size + HTS_ARENA_CHUNK;
 
-        uint32_t psize = 1+1+4;
-        psize += subNameLen;
-        psize += subLen;
+        Chunk *chunk = (Chunk*)malloc(chunkSize);
+        if(!chunk)
+            throw std::bad_alloc();
+        heapAllocations++;
 
-        std::shared_ptr<HtsData> newData;
-        switch(mtype)
-        {
-            case 1:
-                newData = std::make_shared<HtsMap>(psize, tmpbuf);
-                break;
-            case 2:
-                newData = std::make_shared<HtsInt>(psize, tmpbuf);
-                break;
-            case 3:
-                newData = std::make_shared<HtsStr>(psize, tmpbuf);
-                break;
-            case 4:
-                newData = std::make_shared<HtsBin>(psize, tmpbuf);
-                break;
-            case 5:
-                newData = std::make_shared<HtsList>(psize, tmpbuf);
-                break;
-        }
-
-        setData(newData->getName(), newData);
+        chunk->next = chunks;
+        chunk->size = chunkSize;
+        chunks = chunk;
 
-        tmpbuf += psize;
-        mlen -= psize;
+        cur = (char*)chunk + HTS_ARENA_ALIGN;
+        end = (char*)chunk + chunkSize;
     }
-}
 
-HtsMessage HtsMap::makeMsg()
-{
-    HtsMessage res;
-    res.setRoot(std::make_shared<HtsMap>(*this));
+    void *res = cur;
+    cur += size;
     return res;
 }
 
-bool HtsMap::contains(const std::string &name)
+struct HtsArenaNoDelete
 {
-    return data.count(name) > 0;
-}
+    void operator()(void *) const {}
+};
 
-uint32_t HtsMap::getU32(const std::string &name)
+HtsBuffer HtsArena::allocateBuffer(size_t size)
 {
-    return getData(name)->getU32();
+    // The control block holds an allocator, which is what keeps the arena alive
+    return HtsBuffer(allocate(size), HtsArenaNoDelete(), HtsArenaAllocator<char>(this));
 }
 
-int64_t HtsMap::getS64(const std::string &name)
+void HtsArena::reset()
 {
-    return getData(name)->getS64();
+    // Keep the largest chunk around for the next message
+    Chunk *keep = 0;
+    for(Chunk *chunk = chunks; chunk; chunk = chunk->next)
+        if(chunk->size <= HTS_ARENA_KEEP && (!keep || chunk->size > keep->size))
+            keep = chunk;
+
+    while(chunks)
+    {
+        Chunk *next = chunks->next;
+        if(chunks != keep)
+            free(chunks);
+        chunks = next;
+    }
+
+    if(keep)
+        keep->next = 0;
+    chunks = keep;
+
+    cur = chunks ? (char*)chunks + HTS_ARENA_ALIGN : 0;
+    end = chunks ? (char*)chunks + chunks->size : 0;
 }
 
-const std::string &HtsMap::getStr(const std::string &name)
+void HtsArena::release()
 {
-    return getData(name)->getStr();
+    if(refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    if(pool)
+        pool->recycle(this);
+    else
+        delete this;
 }
 
-void HtsMap::getBin(const std::string &name, uint32_t *len, void **buf)
+
+HtsArenaPool *HtsArenaPool::Create()
 {
-    getData(name)->getBin(len, buf);
+    return new HtsArenaPool();
 }
 
-std::shared_ptr<HtsList> HtsMap::getList(const std::string &name)
+HtsArenaPool::HtsArenaPool()
+    :refs(1)
+    ,closed(false)
+    ,idle(0)
+    ,idleCount(0)
+    ,created(0)
+    ,reused(0)
 {
-    std::shared_ptr<HtsData> dat = getData(name);
-    if(!dat->isList())
-        return std::make_shared<HtsList>();
-    return std::static_pointer_cast<HtsList>(dat);
+    lock.clear();
 }
 
-std::shared_ptr<HtsMap> HtsMap::getMap(const std::string &name)
+HtsArena *HtsArenaPool::acquire()
 {
-    std::shared_ptr<HtsData> dat = getData(name);
-    if(!dat->isMap())
-        return std::make_shared<HtsMap>();
-    return std::static_pointer_cast<HtsMap>(dat);
+    HtsArena *res = 0;
+
+    while(lock.test_and_set(std::memory_order_acquire));
+    if(idle)
+    {
+        res = idle;
+        idle = res->nextFree;
+        idleCount--;
+    }
+    lock.clear(std::memory_order_release);
+
+    refs++;
+
+    if(res)
+    {
+        reused++;
+        res->refs = 1;
+        return res;
+    }
+
+    created++;
+    return HtsArena::Create(this);
 }
 
-std::shared_ptr<HtsData> HtsMap::getData(const std::string &name)
+void HtsArenaPool::recycle(HtsArena *arena)
 {
-    if(!contains(name))
-        return std::make_shared<HtsData>();
-    return data.at(name);
+    arena->reset();
+
+    while(lock.test_and_set(std::memory_order_acquire));
+    bool keep = !closed && idleCount < HTS_POOL_IDLE;
+    if(keep)
+    {
+        arena->nextFree = idle;
+        idle = arena;
+        idleCount++;
+    }
+    lock.clear(std::memory_order_release);
+
+    if(!keep)
+        delete arena;
+
+    release();
 }
 
-void HtsMap::setData(const std::string &name, std::shared_ptr<HtsData> newData)
+void HtsArenaPool::close()
 {
-    newData->setName(name);
-    data[name] = newData;
+    while(lock.test_and_set(std::memory_order_acquire));
+    closed = true;
+    HtsArena *list = idle;
+    idle = 0;
+    idleCount = 0;
+    lock.clear(std::memory_order_release);
+
+    while(list)
+    {
+        HtsArena *next = list->nextFree;
+        delete list;
+        list = next;
+    }
+
+    release();
 }
 
-void HtsMap::setData(const std::string &name, uint32_t newData)
+void HtsArenaPool::release()
 {
-    setData(name, std::make_shared<HtsInt>(newData));
+    if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
 }
 
-void HtsMap::setData(const std::string &name, int32_t newData)
+
+#define HTS_KEY_TABLE 512
+
+static uint32_t hashName(const unsigned char *name, uint32_t length)
 {
-    setData(name, std::make_shared<HtsInt>(newData));
+    uint32_t hash = 2166136261u;
+    for(uint32_t i = 0; i < length; i++)
+        hash = (hash ^ name[i]) * 16777619u;
+    return hash;
 }
 
-void HtsMap::setData(const std::string &name, uint64_t newData)
+struct HtsKeyTable
 {
-    setData(name, std::make_shared<HtsInt>(newData));
-}
+    HtsKeyTable()
+    {
+        memset(slots, 0, sizeof(slots));
+        for(uint16_t id = 1; id < HTS_KEY_COUNT; id++)
+        {
+            uint32_t slot = hashName((const unsigned char*)keys[id].name, keys[id].length) % HTS_KEY_TABLE;
+            while(slots[slot])
+                slot = (slot + 1) % HTS_KEY_TABLE;
+            slots[slot] = id;
+        }
+    }
 
-void HtsMap::setData(const std::string &name, int64_t newData)
+    uint16_t lookup(const unsigned char *name, uint32_t length) const
+    {
+        uint32_t slot = hashName(name, length) % HTS_KEY_TABLE;
+        while(slots[slot])
+        {
+            const HtsKey &key = keys[slots[slot]];
+            if(key.length == length && memcmp(key.name, name, length) == 0)
+                return key.id;
+            slot = (slot + 1) % HTS_KEY_TABLE;
+        }
+        return HTS_KEY_NONE;
+    }
+
+    static const HtsKey keys[HTS_KEY_COUNT];
+    uint16_t slots[HTS_KEY_TABLE];
+};
+
+const HtsKey HtsKeyTable::keys[HTS_KEY_COUNT] =
 {
-    setData(name, std::make_shared<HtsInt>(newData));
-}
+    HtsKey(HTS_KEY_NONE, "", 0),
+#define HTS_KEY_ENTRY(name) HtsKeys::name,
+    HTS_KEYS(HTS_KEY_ENTRY)
+#undef HTS_KEY_ENTRY
+};
+
+static const HtsKeyTable keyTable;
 
-void HtsMap::setData(const std::string &name, const std::string &newData)
+void HtsNodeTable::grow()
 {
-    setData(name, std::make_shared<HtsStr>(newData));
+    // The old array stays behind in the arena until the message is gone
+    HtsNode *newNodes = (HtsNode*)arena->allocate(capacity * 2 * sizeof(HtsNode));
+    memcpy(newNodes, nodes, count * sizeof(HtsNode));
+    nodes = newNodes;
+    capacity *= 2;
 }
 
-
-HtsList::HtsList(uint32_t /*length*/, void *buf)
+int64_t HtsWireField::getS64() const
 {
-    char *tmpbuf = (char*)buf;
+    if(type != 2)
+        return 0;
 
-    if(tmpbuf[0] != getType())
-        return;
-    tmpbuf += 1;
+    uint32_t len = length;
+    if(len > 8)
+        len = 8;
+
+    uint64_t u64 = 0;
+    for(int32_t i = len - 1; i >= 0; i--)
+        u64 = (u64 << 8) | data[i];
+    return u64;
+}
 
-    unsigned char nlen = (unsigned char)tmpbuf[0];
-    tmpbuf += 1;
+bool HtsWireReader::next(HtsWireField &field)
+{
+    // Anything shorter than a field header terminates the container
+    if(failed || end - pos < 6)
+        return false;
 
-    int64_t mlen = ntohl(*((uint32_t*)tmpbuf));
-    tmpbuf += sizeof(uint32_t);
+    field.type = pos[0];
+    field.nameLength = pos[1];
+    field.length = readU32(pos + 2);
+    field.name = pos + 6;
+    field.data = field.name + field.nameLength;
 
-    if(nlen > 0)
+    if((uint64_t)field.nameLength + field.length > (uint64_t)(end - field.name))
     {
-        setName(std::string(tmpbuf, (size_t)nlen));
-        tmpbuf += nlen;
+        failed = true;
+        return false;
     }
 
-    while(mlen > 0)
+    field.key = HTS_KEY_NONE;
+    if(field.nameLength)
+        field.key = keyTable.lookup(field.name, field.nameLength);
+
+    pos = field.data + field.length;
+    return true;
+}
+
+std::shared_ptr<HtsIndex> HtsIndex::Build(uint32_t length, HtsBuffer buf, HtsArena *arena)
+{
+    std::shared_ptr<HtsIndex> res = std::allocate_shared<HtsIndex>(HtsArenaAllocator<HtsIndex>(arena), arena);
+    res->buffer = std::move(buf);
+    res->base = (const unsigned char*)res->buffer.get();
+
+    HtsNode root;
+    root.type = 1;
+    root.nameLength = 0;
+    root.key = HTS_KEY_NONE;
+    root.name = 0;
+    root.span.data = 0;
+    root.span.length = length;
+    res->nodes.push_back(root);
+
+    // The node array doubles as the work queue: containers still hold their
+    // span when they are reached and get it replaced by their child range
+    for(uint32_t n = 0; n < res->nodes.size(); n++)
     {
-        unsigned char mtype = (unsigned char)tmpbuf[0];
-        unsigned char subNameLen = (unsigned char)tmpbuf[1];
-        uint32_t subLen = ntohl(*((uint32_t*)(tmpbuf+2)));
+        unsigned char type = res->nodes[n].type;
+        if(type != 1 && type != 5)
+            continue;
 
-        uint32_t psize = 1+1+4;
-        psize += subNameLen;
-        psize += subLen;
+        HtsWireReader reader(res->base + res->nodes[n].span.data, res->nodes[n].span.length);
+        HtsWireField field;
+        uint32_t first = res->nodes.size();
 
-        std::shared_ptr<HtsData> newData;
-        switch(mtype)
+        while(reader.next(field))
         {
-            case 1:
-                newData = std::make_shared<HtsMap>(psize, tmpbuf);
-                break;
-            case 2:
-                newData = std::make_shared<HtsInt>(psize, tmpbuf);
-                break;
-            case 3:
-                newData = std::make_shared<HtsStr>(psize, tmpbuf);
-                break;
-            case 4:
-                newData = std::make_shared<HtsBin>(psize, tmpbuf);
-                break;
-            case 5:
-                newData = std::make_shared<HtsList>(psize, tmpbuf);
-                break;
+            HtsNode node;
+            node.type = field.type;
+            node.nameLength = field.nameLength;
+            node.key = field.key;
+            node.name = field.name - res->base;
+
+            if(field.type == 2)
+                node.s64 = field.getS64();
+            else
+            {
+                node.span.data = field.data - res->base;
+                node.span.length = field.length;
+            }
+
+            res->nodes.push_back(node);
         }
 
-        appendData(newData);
+        if(!reader.isValid())
+            return std::shared_ptr<HtsIndex>();
 
-        tmpbuf += psize;
-        mlen -= psize;
+        res->nodes[n].children.first = first;
+        res->nodes[n].children.count = res->nodes.size() - first;
     }
+
+    return res;
 }
 
-uint32_t HtsList::count()
+
+int64_t HtsData::getS64() const
 {
-    return data.size();
+    if(getType() != 2)
+        return 0;
+    return getNode().s64;
 }
 
-std::shared_ptr<HtsData> HtsList::getData(uint32_t n)
+HtsStrView HtsData::getStrView() const
 {
-    if(n >= data.size())
-        return std::make_shared<HtsData>();
-    return data.at(n);
+    if(getType() != 3)
+        return HtsStrView();
+    const HtsNode &n = getNode();
+    return HtsStrView((const char*)index->getBase() + n.span.data, n.span.length);
 }
 
-void HtsList::appendData(std::shared_ptr<HtsData> newData)
+void HtsData::getBin(uint32_t *len, void **buf) const
 {
-    newData->setName("");
-    data.push_back(newData);
+    const void *view;
+    getBinView(len, &view);
+
+    *buf = 0;
+    if(view)
+    {
+        *buf = malloc(*len);
+        memcpy(*buf, view, *len);
+    }
 }
 
+void HtsData::getBinView(uint32_t *len, const void **buf) const
+{
+    if(getType() != 4)
+    {
+        *len = 0;
+        *buf = 0;
+        return;
+    }
+    const HtsNode &n = getNode();
+    *len = n.span.length;
+    *buf = index->getBase() + n.span.data;
+}
 
-HtsInt::HtsInt(uint32_t /*length*/, void *buf)
+std::string HtsData::getName() const
 {
-    data = 0;
-    unsigned char *tmpbuf = (unsigned char*)buf;
+    if(!index)
+        return std::string();
+    const HtsNode &n = getNode();
+    return std::string((const char*)index->getBase() + n.name, n.nameLength);
+}
 
-    if(tmpbuf[0] != getType())
-        return;
 
-    unsigned char nlen = tmpbuf[1];
-    uint32_t len = ntohl(*((uint32_t*)(tmpbuf+2)));
-    if(len > 8)
-        len = 8;
-    if(len == 0)
-        return;
+HtsMap::HtsMap(const HtsData &data)
+{
+    if(data.isMap())
+        HtsData::operator=(data);
+}
 
-    tmpbuf += 6;
+uint32_t HtsMap::findNode(const std::string &name) const
+{
+    if(!index)
+        return 0;
 
-    if(nlen > 0)
+    const HtsNode &self = getNode();
+    const unsigned char *base = index->getBase();
+    for(uint32_t i = self.children.first; i < self.children.first + self.children.count; i++)
     {
-        setName(std::string((char*)tmpbuf, (size_t)nlen));
-        tmpbuf += nlen;
+        const HtsNode &n = index->getNode(i);
+        if(n.nameLength == name.length() && memcmp(base + n.name, name.data(), n.nameLength) == 0)
+            return i;
     }
+    return 0;
+}
 
-    uint64_t u64 = 0;
-    for(int32_t i = len - 1; i >= 0; i--)
-        u64 = (u64 << 8) | tmpbuf[i];
-    data = u64;
+uint32_t HtsMap::findNode(const HtsKey &key) const
+{
+    if(!index)
+        return 0;
+
+    const HtsNode &self = getNode();
+    for(uint32_t i = self.children.first; i < self.children.first + self.children.count; i++)
+        if(index->getNode(i).key == key.id)
+            return i;
+    return 0;
 }
 
+bool HtsMap::contains(const std::string &name) const
+{
+    return findNode(name) != 0;
+}
 
-HtsStr::HtsStr(uint32_t /*length*/, void *buf)
+bool HtsMap::contains(const HtsKey &key) const
 {
-    char *tmpbuf = (char*)buf;
+    return findNode(key) != 0;
+}
 
-    if(tmpbuf[0] != getType())
-        return;
+uint32_t HtsMap::getU32(const std::string &name) const
+{
+    return getData(name).getU32();
+}
 
-    unsigned char nlen = (unsigned char)tmpbuf[1];
-    uint32_t len = ntohl(*((uint32_t*)(tmpbuf+2)));
+uint32_t HtsMap::getU32(const HtsKey &key) const
+{
+    return getData(key).getU32();
+}
 
-    tmpbuf += 6;
+int64_t HtsMap::getS64(const std::string &name) const
+{
+    return getData(name).getS64();
+}
 
-    if(nlen > 0)
-    {
-        setName(std::string(tmpbuf, (size_t)nlen));
-        tmpbuf += nlen;
-    }
+int64_t HtsMap::getS64(const HtsKey &key) const
+{
+    return getData(key).getS64();
+}
+
+std::string HtsMap::getStr(const std::string &name) const
+{
+    return getData(name).getStr();
+}
 
-    data = std::string(tmpbuf, (size_t)len);
+std::string HtsMap::getStr(const HtsKey &key) const
+{
+    return getData(key).getStr();
 }
 
+HtsStrView HtsMap::getStrView(const std::string &name) const
+{
+    return getData(name).getStrView();
+}
 
-HtsBin::HtsBin(const HtsBin &other)
+HtsStrView HtsMap::getStrView(const HtsKey &key) const
 {
-    other.getBin(&data_length, &data_buf);
+    return getData(key).getStrView();
 }
 
-HtsBin::HtsBin(uint32_t /*length*/, void *buf)
+void HtsMap::getBin(const std::string &name, uint32_t *len, void **buf) const
 {
-    char *tmpbuf = (char*)buf;
+    getData(name).getBin(len, buf);
+}
 
-    if(tmpbuf[0] != getType())
-        return;
+void HtsMap::getBin(const HtsKey &key, uint32_t *len, void **buf) const
+{
+    getData(key).getBin(len, buf);
+}
 
-    unsigned char nlen = (unsigned char)tmpbuf[1];
-    data_length = ntohl(*((uint32_t*)(tmpbuf+2)));
+void HtsMap::getBinView(const std::string &name, uint32_t *len, const void **buf) const
+{
+    getData(name).getBinView(len, buf);
+}
 
-    tmpbuf += 6;
+void HtsMap::getBinView(const HtsKey &key, uint32_t *len, const void **buf) const
+{
+    getData(key).getBinView(len, buf);
+}
 
-    if(nlen > 0)
-    {
-        setName(std::string(tmpbuf, (size_t)nlen));
-        tmpbuf += nlen;
-    }
+HtsList HtsMap::getList(const std::string &name) const
+{
+    return HtsList(getData(name));
+}
 
-    data_buf = malloc(data_length);
-    memcpy(data_buf, tmpbuf, data_length);
+HtsList HtsMap::getList(const HtsKey &key) const
+{
+    return HtsList(getData(key));
 }
 
-void HtsBin::getBin(uint32_t *len, void **buf) const
+HtsMap HtsMap::getMap(const std::string &name) const
 {
-    *len = data_length;
-    void *mem = malloc(data_length);
-    memcpy(mem, data_buf, data_length);
-    *buf = mem;
+    return HtsMap(getData(name));
 }
 
-void HtsBin::setBin(uint32_t len, void *buf)
+HtsMap HtsMap::getMap(const HtsKey &key) const
 {
-    if(data_buf)
-        free(data_buf);
+    return HtsMap(getData(key));
+}
 
-    data_length = len;
-    data_buf = malloc(len);
-    memcpy(data_buf, buf, len);
+HtsData HtsMap::getData(const std::string &name) const
+{
+    uint32_t n = findNode(name);
+    if(!n)
+        return HtsData();
+    return HtsData(index, n);
 }
 
-HtsBin::~HtsBin()
+HtsData HtsMap::getData(const HtsKey &key) const
 {
-    if(data_buf)
-        free(data_buf);
+    uint32_t n = findNode(key);
+    if(!n)
+        return HtsData();
+    return HtsData(index, n);
 }
 
 
-HtsMessage HtsMessage::Deserialize(uint32_t length, void *buf)
+HtsList::HtsList(const HtsData &data)
 {
-    char *tmpbuf = (char*)buf;
+    if(data.isList())
+        HtsData::operator=(data);
+}
 
-    HtsMap res;
+uint32_t HtsList::count() const
+{
+    if(!index)
+        return 0;
+    return getNode().children.count;
+}
 
-    while(length > 5)
-    {
-        unsigned char mtype = (unsigned char)tmpbuf[0];
-        unsigned char subNameLen = (unsigned char)tmpbuf[1];
-        uint32_t subLen = ntohl(*((uint32_t*)(tmpbuf+2)));
+HtsData HtsList::getData(uint32_t n) const
+{
+    if(n >= count())
+        return HtsData();
+    return HtsData(index, getNode().children.first + n);
+}
 
-        uint32_t psize = 6;
-        psize += subNameLen;
-        psize += subLen;
 
-        std::shared_ptr<HtsData> newData;
-        switch(mtype)
-        {
-            case 1:
-                newData = std::make_shared<HtsMap>(psize, tmpbuf);
-                break;
-            case 2:
-                newData = std::make_shared<HtsInt>(psize, tmpbuf);
-                break;
-            case 3:
-                newData = std::make_shared<HtsStr>(psize, tmpbuf);
-                break;
-            case 4:
-                newData = std::make_shared<HtsBin>(psize, tmpbuf);
-                break;
-            case 5:
-                newData = std::make_shared<HtsList>(psize, tmpbuf);
-                break;
-        }
+HtsMessage::HtsMessage(HtsMessage &&other)
+    :valid(other.valid)
+    ,root(other.root)
+    ,index(std::move(other.index))
+    ,data(other.data)
+    ,length(other.length)
+    ,buffer(std::move(other.buffer))
+    ,arena(other.arena)
+{
+    other.valid = false;
+    other.root = HtsMap();
+    other.data = 0;
+    other.length = 0;
+    other.arena = 0;
+}
+
+HtsMessage &HtsMessage::operator=(HtsMessage &&other)
+{
+    if(this == &other)
+        return *this;
+
+    valid = other.valid;
+    root = other.root;
+    index = std::move(other.index);
+    data = other.data;
+    length = other.length;
+    buffer = std::move(other.buffer);
+    arena = other.arena;
 
-        res.setData(newData->getName(), newData);
+    other.valid = false;
+    other.root = HtsMap();
+    other.data = 0;
+    other.length = 0;
+    other.arena = 0;
+    return *this;
+}
 
-        length -= psize;
-        tmpbuf += psize;
+HtsMap *HtsMessage::getRoot()
+{
+    if(buffer)
+    {
+        if(arena)
+            arena->hold();
+        else
+            arena = HtsArena::Create();
+
+        index = HtsIndex::Build(length, std::move(buffer), arena);
+        if(index)
+            root = HtsMap(HtsData(index.get(), 0));
+        else
+            valid = false;
+
+        arena->release();
+        arena = 0;
+        buffer.reset();
     }
 
-    return res.makeMsg();
+    return &root;
 }
 
-bool HtsMessage::Serialize(uint32_t *length, void **buf)
+const HtsBuffer &HtsMessage::getBuffer() const
 {
-    unsigned char *resBuf = 0;
-    uint32_t resLength = 4;
-    *length = 0;
-    *buf = 0;
+    static const HtsBuffer noBuffer;
+    if(index)
+        return index->getBuffer();
+    return buffer ? buffer : noBuffer;
+}
+
+HtsMessage HtsMessage::Deserialize(uint32_t length, void *buf)
+{
+    void *copy = malloc(length);
+    if(!copy)
+        return HtsMessage();
+    memcpy(copy, buf, length);
+
+    return Deserialize(length, HtsBuffer(copy, free));
+}
 
-    std::shared_ptr<HtsMap> map = getRoot();
-    auto umap = map->getRawData();
-    for(auto it = umap.begin(); it != umap.end(); ++it)
-        resLength += it->second->calcSize();
+HtsMessage HtsMessage::Deserialize(uint32_t length, HtsBuffer owner, HtsArena *arena)
+{
+    HtsMessage msg = Wrap(length, std::move(owner), arena);
+    msg.getRoot();
+    return msg;
+}
 
-    resBuf = (unsigned char*)malloc(resLength);
-    memset(resBuf, 0xFF, resLength);
+HtsMessage HtsMessage::Wrap(uint32_t length, HtsBuffer owner, HtsArena *arena)
+{
+    HtsMessage msg;
+    if(!owner)
+        return msg;
 
-    *((uint32_t*)resBuf) = htonl(resLength);
+    msg.valid = true;
+    msg.data = owner.get();
+    msg.length = length;
+    msg.buffer = std::move(owner);
+    msg.arena = arena;
+    return msg;
+}
 
-    char *tmpbuf = (char*)resBuf;
-    tmpbuf += 4;
 
-    for(auto it = umap.begin(); it != umap.end(); ++it)
+#define HTS_WRITER_MIN 256
+
+unsigned char *HtsWriter::reserve(uint32_t size)
+{
+    if(capacity - length < size)
     {
-        it->second->Serialize(tmpbuf);
-        tmpbuf += it->second->calcSize();
+        uint32_t newCapacity = capacity ? capacity : HTS_WRITER_MIN;
+        while(newCapacity - length < size)
+            newCapacity *= 2;
+
+        unsigned char *newBuf = (unsigned char*)realloc(buf, newCapacity);
+        if(!newBuf)
+            throw std::bad_alloc();
+        buf = newBuf;
+        capacity = newCapacity;
     }
 
-    *length = resLength+4;
-    *buf = resBuf;
-    return true;
+    unsigned char *res = buf + length;
+    length += size;
+    return res;
 }
 
-uint32_t HtsMap::calcSize()
+static void writeU32(unsigned char *buf, uint32_t value)
 {
-    return pCalcSize() + 6 + getName().length();
+    buf[0] = (value >> 24) & 0xFF;
+    buf[1] = (value >> 16) & 0xFF;
+    buf[2] = (value >> 8) & 0xFF;
+    buf[3] = value & 0xFF;
 }
 
-uint32_t HtsMap::pCalcSize()
+void HtsWriter::beginFrame()
 {
-    uint32_t totalSize = 0;
-    for(auto it = data.begin(); it != data.end(); ++it)
-    {
-        totalSize += it->second->calcSize();
-    }
-    return totalSize;
+    length = frame = committed;
+    reserve(4);
 }
 
-void HtsMap::Serialize(void *buf)
+void HtsWriter::endFrame()
 {
-    unsigned char *tmpbuf = (unsigned char*)buf;
+    writeU32(buf + frame, length - frame - 4);
+    committed = length;
+}
 
-    tmpbuf[0] = getType();
-    tmpbuf[1] = getName().length();
+unsigned char *HtsWriter::writeHeader(unsigned char type, const char *name, uint8_t nameLength, uint32_t dataLength)
+{
+    unsigned char *tmpbuf = reserve(6 + nameLength + dataLength);
 
-    *((uint32_t*)(tmpbuf + 2)) = htonl(pCalcSize());
+    tmpbuf[0] = type;
+    tmpbuf[1] = nameLength;
+    writeU32(tmpbuf + 2, dataLength);
     tmpbuf += 6;
 
-    if(getName().length() > 0)
+    if(nameLength > 0)
     {
-        memcpy(tmpbuf, getName().c_str(), getName().length());
-        tmpbuf += getName().length();
+        memcpy(tmpbuf, name, nameLength);
+        tmpbuf += nameLength;
     }
 
-    for(auto it = data.begin(); it != data.end(); ++it)
-    {
-        std::shared_ptr<HtsData> dat = it->second;
-        dat->Serialize(tmpbuf);
-        tmpbuf += dat->calcSize();
-    }
+    return tmpbuf;
 }
 
-uint32_t HtsList::pCalcSize()
+void HtsWriter::writeS64(const char *name, uint8_t nameLength, int64_t value)
 {
-    uint32_t totalSize = 0;
-    for(uint32_t i = 0; i < data.size(); i++)
+    uint64_t u64 = value;
+    uint32_t len = 0;
+    while(u64 != 0)
+    {
+        ++len;
+        u64 = u64 >> 8;
+    }
+
+    unsigned char *tmpbuf = writeHeader(2, name, nameLength, len);
+
+    u64 = value;
+    for(uint32_t i = 0; i < len; i++)
     {
-        totalSize += data.at(i)->calcSize();
+        tmpbuf[i] = (unsigned char)(u64 & 0xFF);
+        u64 = u64 >> 8;
     }
-    return totalSize;
 }
 
-uint32_t HtsList::calcSize()
+void HtsWriter::writeStr(const char *name, uint8_t nameLength, const char *str, uint32_t strLength)
 {
-    return pCalcSize() + 6 + getName().length();
+    memcpy(writeHeader(3, name, nameLength, strLength), str, strLength);
 }
 
-void HtsList::Serialize(void *buf)
+void HtsWriter::writeBin(const char *name, uint8_t nameLength, const void *bin, uint32_t binLength)
 {
-    unsigned char *tmpbuf = (unsigned char*)buf;
+    memcpy(writeHeader(4, name, nameLength, binLength), bin, binLength);
+}
 
-    tmpbuf[0] = getType();
-    tmpbuf[1] = getName().length();
+uint32_t HtsWriter::beginContainer(unsigned char type, const char *name, uint8_t nameLength)
+{
+    uint32_t pos = length;
+    writeHeader(type, name, nameLength, 0);
+    return pos;
+}
 
-    *((uint32_t*)(tmpbuf + 2)) = htonl(pCalcSize());
-    tmpbuf += 6;
+void HtsWriter::endContainer(uint32_t pos)
+{
+    uint32_t start = pos + 6 + buf[pos + 1];
+    writeU32(buf + pos + 2, length - start);
+}
 
-    if(getName().length() > 0)
-    {
-        memcpy(tmpbuf, getName().c_str(), getName().length());
-        tmpbuf += getName().length();
-    }
+void HtsMessageBuilder::setData(const HtsKey &key, const std::list<int64_t> &newData)
+{
+    uint32_t pos = beginList(key);
+    for(auto it = newData.begin(); it != newData.end(); ++it)
+        appendData(*it);
+    endList(pos);
+}
 
-    for(uint32_t i = 0; i < data.size(); i++)
-    {
-        std::shared_ptr<HtsData> d = data.at(i);
-        d->Serialize(tmpbuf);
-        tmpbuf += d->calcSize();
-    }
+
+HtsStreamParser::HtsStreamParser(const HtsKey &list, const Callback &callback, HtsArenaPool *pool)
+    :list(list)
+    ,callback(callback)
+    ,pool(pool)
+    ,elementArena(0)
+{
+    begin(0);
 }
 
-uint32_t HtsInt::calcSize()
+bool HtsStreamParser::matches(const void *header, uint32_t length) const
 {
-    return pCalcSize() + getName().length() + 6;
+    const unsigned char *field = (const unsigned char*)header;
+    return length >= 6u + list.length && field[0] == 5 && field[1] == list.length
+        && memcmp(field + 6, list.name, list.length) == 0;
 }
 
-uint32_t HtsInt::pCalcSize()
+void HtsStreamParser::begin(uint32_t length)
 {
-    uint64_t u64 = data;
-    uint32_t res = 0;
-    while(u64 != 0)
+    state = STATE_HEADER;
+    failed = false;
+    inList = false;
+    frameLeft = length;
+    listLeft = 0;
+    dataLeft = 0;
+    elements = 0;
+
+    pending.clear();
+    pendingNeed = 6;
+
+    top.clear();
+    element.reset();
+}
+
+bool HtsStreamParser::feed(const void *data, uint32_t length)
+{
+    const unsigned char *in = (const unsigned char*)data;
+
+    if(length > frameLeft)
+        failed = true;
+
+    while(length > 0 && !failed)
     {
-        ++res;
-        u64 = u64 >> 8;
+        uint32_t take;
+
+        if(state == STATE_HEADER)
+        {
+            // Like Build, anything shorter than a field header ends the container
+            uint32_t scope = inList ? listLeft : frameLeft;
+            if(pending.empty() && scope < 6)
+            {
+                dataLeft = scope;
+                state = STATE_SKIP;
+                continue;
+            }
+
+            take = std::min(length, pendingNeed - (uint32_t)pending.size());
+            pending.insert(pending.end(), in, in + take);
+        }
+        else
+        {
+            take = std::min(length, dataLeft);
+            if(state == STATE_DATA && inList)
+                memcpy((unsigned char*)element.get() + elementLength - dataLeft, in, take);
+            else if(state == STATE_DATA)
+                top.insert(top.end(), in, in + take);
+            dataLeft -= take;
+        }
+
+        in += take;
+        length -= take;
+        frameLeft -= take;
+        if(inList)
+            listLeft -= take;
+
+        if(state == STATE_HEADER && pending.size() == pendingNeed)
+        {
+            if(pendingNeed == 6 && pending[1] > 0)
+            {
+                // The name has to fit in what is left of the container,
+                // or listLeft would wrap while it is read
+                if(pending[1] > (inList ? listLeft : frameLeft))
+                    failed = true;
+                pendingNeed += pending[1];
+            }
+            else
+                onHeader();
+        }
+        else if(state != STATE_HEADER && dataLeft == 0)
+            endData();
     }
-    return res;
+
+    return !failed;
 }
 
-void HtsInt::Serialize(void *buf)
+void HtsStreamParser::onHeader()
 {
-    uint32_t len = pCalcSize();
-    unsigned char *tmpbuf = (unsigned char*)buf;
+    unsigned char type = pending[0];
+    uint32_t nameLength = pending[1];
+    uint32_t length = readU32(&pending[2]);
 
-    tmpbuf[0] = getType();
-    tmpbuf[1] = getName().length();
+    if(length > (inList ? listLeft : frameLeft))
+    {
+        failed = true;
+        return;
+    }
 
-    *((uint32_t*)(tmpbuf + 2)) = htonl(len);
-    tmpbuf += 6;
+    dataLeft = length;
+    state = STATE_DATA;
 
-    if(getName().length() > 0)
+    if(inList)
     {
-        memcpy(tmpbuf, getName().c_str(), getName().length());
-        tmpbuf += getName().length();
+        // Elements other than maps are of no interest
+        if(type != 1)
+            state = STATE_SKIP;
+        else
+        {
+            // The buffer keeps the arena alive from here on
+            elementArena = pool ? pool->acquire() : HtsArena::Create();
+            element = elementArena->allocateBuffer(length);
+            elementArena->release();
+            elementLength = length;
+        }
     }
-
-    uint64_t u64 = data;
-    for(uint32_t i = 0; i < len; i++)
+    else if(type == 5 && nameLength == list.length && memcmp(&pending[6], list.name, nameLength) == 0)
     {
-        tmpbuf[i] = (unsigned char)(u64 & 0xFF);
-        u64 = u64 >> 8;
+        // The list itself is kept, but empty
+        memset(&pending[2], 0, 4);
+        top.insert(top.end(), pending.begin(), pending.end());
+
+        inList = true;
+        listLeft = length;
+        dataLeft = 0;
+        state = STATE_HEADER;
     }
-}
+    else
+        top.insert(top.end(), pending.begin(), pending.end());
 
-uint32_t HtsStr::calcSize()
-{
-    return data.length() + getName().length() + 6;
+    pending.clear();
+    pendingNeed = 6;
+
+    if(state != STATE_HEADER && dataLeft == 0)
+        endData();
+    else if(inList && listLeft == 0)
+        endField();
 }
 
-void HtsStr::Serialize(void *buf)
+void HtsStreamParser::endData()
 {
-    unsigned char *tmpbuf = (unsigned char*)buf;
-
-    tmpbuf[0] = getType();
-    tmpbuf[1] = getName().length();
+    if(state == STATE_DATA && inList)
+    {
+        HtsMessage msg = HtsMessage::Deserialize(elementLength, std::move(element), elementArena);
 
-    *((uint32_t*)(tmpbuf + 2)) = htonl(data.length());
-    tmpbuf += 6;
+        if(!msg.isValid())
+        {
+            failed = true;
+            return;
+        }
 
-    if(getName().length() > 0)
-    {
-        memcpy(tmpbuf, getName().c_str(), getName().length());
-        tmpbuf += getName().length();
+        elements++;
+        callback(*msg.getRoot());
     }
 
-    memcpy(tmpbuf, data.c_str(), data.length());
+    endField();
 }
 
-uint32_t HtsBin::calcSize()
+void HtsStreamParser::endField()
 {
-    return data_length + getName().length() + 6;
+    state = STATE_HEADER;
+    if(inList && listLeft == 0)
+        inList = false;
 }
 
-void HtsBin::Serialize(void *buf)
+HtsMessage HtsStreamParser::finish()
 {
-    unsigned char *tmpbuf = (unsigned char*)buf;
+    if(failed || frameLeft > 0)
+        return HtsMessage();
 
-    tmpbuf[0] = getType();
-    tmpbuf[1] = getName().length();
-
-    *((uint32_t*)(tmpbuf + 2)) = htonl(data_length);
-    tmpbuf += 6;
-
-    if(getName().length() > 0)
-    {
-        memcpy(tmpbuf, getName().c_str(), getName().length());
-        tmpbuf += getName().length();
-    }
+    HtsArena *arena = pool ? pool->acquire() : HtsArena::Create();
+    HtsBuffer owner = arena->allocateBuffer(top.size());
+    arena->release();
+    memcpy(owner.get(), top.data(), top.size());
 
-    memcpy(tmpbuf, data_buf, data_length);
+    return HtsMessage::Deserialize(top.size(), std::move(owner), arena);
 }
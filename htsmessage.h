@@ -19,198 +19,590 @@
 #ifndef H__HTSMESSAGEPP__H__
 #define H__HTSMESSAGEPP__H__
 
-#include <unordered_map>
 #include <cstdint>
 #include <string>
 #include <vector>
 #include <memory>
 #include <list>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <utility>
 
+class HtsData;
 class HtsMap;
 class HtsList;
-class HtsInt;
-class HtsStr;
-class HtsBin;
 class HtsMessage;
+class HtsIndex;
+class HtsArenaPool;
 
-extern const std::string emptyString;
+/* Reference counted receive buffer. Parsed messages keep it alive so binary
+ * fields can point into it instead of holding their own copy. */
+typedef std::shared_ptr<void> HtsBuffer;
 
-class HtsData
+/* Bump allocator holding everything a parsed message needs: the receive
+ * buffer and its node table. It is reference counted and goes back to its
+ * pool, or is freed, in one step once the last of them is gone. */
+class HtsArena
 {
     public:
-    HtsData() {}
-    virtual ~HtsData() {}
+    static HtsArena *Create(HtsArenaPool *pool = 0);
+
+    void *allocate(size_t size);
+    HtsBuffer allocateBuffer(size_t size);
+
+    void hold() { refs.fetch_add(1, std::memory_order_relaxed); }
+    void release();
 
-    virtual uint32_t getU32() { return 0; }
-    virtual int64_t getS64() { return 0; }
-    virtual const std::string &getStr() { return emptyString; }
-    virtual void getBin(uint32_t *len, void **buf) const { *len = 0; *buf = 0; }
+    /* Number of heap allocations made by all arenas so far */
+    static uint64_t getHeapAllocations() { return heapAllocations; }
 
-    virtual uint32_t calcSize() { printf("WARNING!\n"); return 0; }
-    virtual void Serialize(void *) { printf("WARNING!\n"); }
+    private:
+    friend class HtsArenaPool;
+
+    HtsArena(HtsArenaPool *pool);
+    ~HtsArena();
+    void reset();
+
+    struct Chunk
+    {
+        Chunk *next;
+        size_t size;
+    };
+
+    Chunk *chunks;
+    char *cur;
+    char *end;
+    std::atomic<uint32_t> refs;
+    HtsArenaPool *pool;
+    HtsArena *nextFree;
+
+    static std::atomic<uint64_t> heapAllocations;
+};
 
-    virtual bool isMap() { return false; }
-    virtual bool isList() { return false; }
-    virtual bool isInt() { return false; }
-    virtual bool isStr() { return false; }
-    virtual bool isBin() { return false; }
-    virtual unsigned char getType() { return 0; }
+/* Keeps a few idle arenas around so that steady state message parsing does
+ * not touch the heap. The pool stays alive until its owner has closed it and
+ * every arena it handed out came back, since VLC may still hold blocks
+ * pointing into them after the connection is gone. */
+class HtsArenaPool
+{
+    public:
+    static HtsArenaPool *Create();
 
-    virtual bool isValid() { return false; }
+    HtsArena *acquire();
+    void close();
 
-    std::string getName() const { return name; }
-    void setName(const std::string &newName) { name = newName; }
+    uint32_t getCreated() const { return created; }
+    uint32_t getReused() const { return reused; }
 
     private:
-    std::string name;
+    friend class HtsArena;
+
+    HtsArenaPool();
+    void recycle(HtsArena *arena);
+    void release();
+
+    std::atomic_flag lock;
+    std::atomic<uint32_t> refs;
+    bool closed;
+    HtsArena *idle;
+    uint32_t idleCount;
+
+    std::atomic<uint32_t> created;
+    std::atomic<uint32_t> reused;
 };
 
-class HtsMap : public HtsData
+/* Standard allocator on top of an arena. Every copy keeps the arena alive.
+ * Without an arena it falls back to the heap. */
+template<typename T>
+class HtsArenaAllocator
 {
     public:
-    HtsMap() {}
-    HtsMap(uint32_t length, void *buf);
+    typedef T value_type;
+
+    HtsArenaAllocator():arena(0) {}
+    HtsArenaAllocator(HtsArena *arena):arena(arena) { if(arena) arena->hold(); }
+    HtsArenaAllocator(const HtsArenaAllocator &other):arena(other.arena) { if(arena) arena->hold(); }
+    template<typename U>
+    HtsArenaAllocator(const HtsArenaAllocator<U> &other):arena(other.arena) { if(arena) arena->hold(); }
+    ~HtsArenaAllocator() { if(arena) arena->release(); }
+
+    HtsArenaAllocator &operator=(const HtsArenaAllocator &other)
+    {
+        if(other.arena)
+            other.arena->hold();
+        if(arena)
+            arena->release();
+        arena = other.arena;
+        return *this;
+    }
+
+    T *allocate(size_t n)
+    {
+        if(arena)
+            return (T*)arena->allocate(n * sizeof(T));
+        return (T*)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        if(!arena)
+            ::operator delete(p);
+    }
+
+    template<typename U>
+    struct rebind { typedef HtsArenaAllocator<U> other; };
+
+    template<typename U>
+    bool operator==(const HtsArenaAllocator<U> &other) const { return arena == other.arena; }
+    template<typename U>
+    bool operator!=(const HtsArenaAllocator<U> &other) const { return arena != other.arena; }
+
+    HtsArena *arena;
+};
 
-    HtsMessage makeMsg();
+/* Non-owning view of a string field inside a receive buffer. */
+struct HtsStrView
+{
+    HtsStrView():data(0),length(0) {}
+    HtsStrView(const char *data, uint32_t length):data(data),length(length) {}
 
-    bool contains(const std::string &name);
-	using HtsData::getU32;
-    uint32_t getU32(const std::string &name);
-	using HtsData::getS64;
-    int64_t getS64(const std::string &name);
-	using HtsData::getStr;
-    const std::string &getStr(const std::string &name);
-	using HtsData::getBin;
-    void getBin(const std::string &name, uint32_t *len, void **buf);
-    std::shared_ptr<HtsList> getList(const std::string &name);
-    std::shared_ptr<HtsMap> getMap(const std::string &name);
-
-    std::unordered_map<std::string, std::shared_ptr<HtsData>> getRawData() { return data; }
-    std::shared_ptr<HtsData> getData(const std::string &name);
-    void setData(const std::string &name, std::shared_ptr<HtsData> newData);
-    void setData(const std::string &name, uint32_t newData);
-    void setData(const std::string &name, int32_t newData);
-    void setData(const std::string &name, uint64_t newData);
-    void setData(const std::string &name, int64_t newData);
-    void setData(const std::string &name, const std::string &newData);
-
-    virtual uint32_t calcSize();
-    virtual void Serialize(void *buf);
-
-    virtual bool isMap() { return true; }
-    virtual bool isValid() { return true; }
-    virtual unsigned char getType() { return 1; }
+    bool empty() const { return length == 0; }
+    std::string str() const { return std::string(data, length); }
+
+    bool operator==(const char *other) const { return strlen(other) == length && memcmp(data, other, length) == 0; }
+    bool operator!=(const char *other) const { return !(*this == other); }
+
+    const char *data;
+    uint32_t length;
+};
+
+/* Non-owning view of a binary field inside a receive buffer. */
+struct HtsBinView
+{
+    HtsBinView():data(0),length(0) {}
+    HtsBinView(const void *data, uint32_t length):data(data),length(length) {}
+
+    const void *data;
+    uint32_t length;
+};
+
+/* Field names the plugin knows about. The decoder tags every field whose
+ * name is in this list with its id, so lookups through an HtsKey are integer
+ * compares instead of string hashing. */
+#define HTS_KEYS(X) \
+    X(method) X(seq) X(error) X(noaccess) X(subscriptionId) \
+    X(stream) X(payload) X(pts) X(dts) X(duration) X(frametype) \
+    X(clientname) X(servername) X(serverversion) X(htspversion) X(challenge) \
+    X(username) X(digest) \
+    X(events) X(channelId) X(start) X(stop) X(title) X(summary) X(description) \
+    X(queueDepth) X(timeshiftPeriod) X(normts) X(profile) \
+    X(videoCodec) X(audioCodec) X(subtitleCodec) X(language) X(maxResolution) X(channels) X(bandwidth) \
+    X(shift) X(end) X(sourceinfo) X(service) X(streams) X(type) X(index) \
+    X(width) X(height) X(rate) X(meta) X(status) \
+    X(Bdrops) X(Pdrops) X(Idrops) X(packets) X(bytes) X(delay) \
+    X(speed) X(time) X(absolute) X(size) X(enable) X(disable) \
+    X(channelName) X(channelNumber) X(channelIcon) X(tagId) X(tagName) X(members)
+
+enum
+{
+    HTS_KEY_NONE = 0,
+#define HTS_KEY_ID(name) HTS_KEY_##name,
+    HTS_KEYS(HTS_KEY_ID)
+#undef HTS_KEY_ID
+    HTS_KEY_COUNT
+};
+
+class HtsKey
+{
+    public:
+    constexpr HtsKey(uint16_t id, const char *name, uint8_t length):id(id),name(name),length(length) {}
+
+    std::string getName() const { return std::string(name, length); }
+
+    const uint16_t id;
+    const char *const name;
+    const uint8_t length;
+};
+
+namespace HtsKeys
+{
+#define HTS_KEY_CONST(name) constexpr HtsKey name(HTS_KEY_##name, #name, sizeof(#name) - 1);
+    HTS_KEYS(HTS_KEY_CONST)
+#undef HTS_KEY_CONST
+}
+
+/* Growable output buffer for HTSMSG frames. Every field is written exactly
+ * once, the lengths of frames and containers are backpatched when they are
+ * closed. Finished frames stay in the buffer one after the other until
+ * clear(), so several messages can go out in one write; a frame that is
+ * begun but never ended is dropped by the next beginFrame(). Owners keep
+ * one around and reuse its memory for every send. */
+class HtsWriter
+{
+    public:
+    HtsWriter():buf(0),length(0),capacity(0),frame(0),committed(0) {}
+    ~HtsWriter() { free(buf); }
+
+    void beginFrame();
+    void endFrame();
+
+    void writeS64(const char *name, uint8_t nameLength, int64_t value);
+    void writeStr(const char *name, uint8_t nameLength, const char *str, uint32_t strLength);
+    void writeBin(const char *name, uint8_t nameLength, const void *bin, uint32_t binLength);
+
+    uint32_t beginMap(const char *name, uint8_t nameLength) { return beginContainer(1, name, nameLength); }
+    uint32_t beginList(const char *name, uint8_t nameLength) { return beginContainer(5, name, nameLength); }
+    void endContainer(uint32_t pos);
+
+    void clear() { length = committed = frame = 0; }
+
+    const void *getData() const { return buf; }
+    uint32_t getLength() const { return length; }
+
+    /* Finished frames only */
+    uint32_t getCommitted() const { return committed; }
 
     private:
-    uint32_t pCalcSize();
-    std::unordered_map<std::string, std::shared_ptr<HtsData>> data;
+    HtsWriter(const HtsWriter &);
+    HtsWriter &operator=(const HtsWriter &);
+
+    unsigned char *reserve(uint32_t size);
+    unsigned char *writeHeader(unsigned char type, const char *name, uint8_t nameLength, uint32_t dataLength);
+    uint32_t beginContainer(unsigned char type, const char *name, uint8_t nameLength);
+
+    unsigned char *buf;
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t frame;
+    uint32_t committed;
 };
 
- class HtsList : public HtsData
+/* Typed builder for outgoing messages. Fields are encoded into the writer as
+ * they are added, nothing is kept per field. A builder owns its writer until
+ * finish() closes the frame, so only one message per writer can be built at
+ * a time. */
+class HtsMessageBuilder
 {
     public:
-    HtsList() {}
-    HtsList(uint32_t length, void *buf);
+    HtsMessageBuilder(HtsWriter &w):writer(w),start(w.getCommitted()) { writer.beginFrame(); }
 
-    uint32_t count();
-    std::shared_ptr<HtsData> getData(uint32_t n);
-    void appendData(std::shared_ptr<HtsData> newData);
+    void setData(const HtsKey &key, uint32_t newData) { writer.writeS64(key.name, key.length, newData); }
+    void setData(const HtsKey &key, int32_t newData) { writer.writeS64(key.name, key.length, newData); }
+    void setData(const HtsKey &key, uint64_t newData) { writer.writeS64(key.name, key.length, newData); }
+    void setData(const HtsKey &key, int64_t newData) { writer.writeS64(key.name, key.length, newData); }
+    void setData(const HtsKey &key, const char *newData) { writer.writeStr(key.name, key.length, newData, strlen(newData)); }
+    void setData(const HtsKey &key, const std::string &newData) { writer.writeStr(key.name, key.length, newData.data(), newData.length()); }
+    void setData(const HtsKey &key, const void *bin, uint32_t binLength) { writer.writeBin(key.name, key.length, bin, binLength); }
+    void setData(const HtsKey &key, const std::list<int64_t> &newData);
 
-    virtual uint32_t calcSize();
-    virtual void Serialize(void *buf);
+    /* Nested lists: everything added between beginList() and endList() ends
+     * up in the list */
+    uint32_t beginList(const HtsKey &key) { return writer.beginList(key.name, key.length); }
+    void appendData(int64_t newData) { writer.writeS64("", 0, newData); }
+    void appendData(const std::string &newData) { writer.writeStr("", 0, newData.data(), newData.length()); }
+    void endList(uint32_t pos) { writer.endContainer(pos); }
 
-    virtual bool isList() { return true; }
-    virtual bool isValid() { return true; }
-    virtual unsigned char getType() { return 5; }
+    void finish() { writer.endFrame(); }
+
+    const void *getData() const { return (const unsigned char*)writer.getData() + start; }
+    uint32_t getLength() const { return writer.getLength() - start; }
 
     private:
-    uint32_t pCalcSize();
-    std::vector<std::shared_ptr<HtsData>> data;
+    HtsWriter &writer;
+    uint32_t start;
+};
+
+/* One field as it is laid out in the receive buffer */
+struct HtsWireField
+{
+    unsigned char type;
+    uint8_t nameLength;
+    uint16_t key;
+    const unsigned char *name;
+    const unsigned char *data;
+    uint32_t length;
+
+    int64_t getS64() const;
 };
 
-class HtsInt : public HtsData
+/* Walks the fields of one map or list body, checking every length against
+ * the body it is in. Nothing is allocated, nested containers are returned
+ * as a single field and can be walked with a reader of their own. */
+class HtsWireReader
 {
     public:
-    HtsInt():data(0) {}
-    HtsInt(uint32_t length, void *buf);
-    HtsInt(uint32_t data):data(data) {}
-    HtsInt(int32_t data):data(data) {}
-    HtsInt(uint64_t data) { data = (int64_t)data; }
-    HtsInt(int64_t data):data(data) {}
+    HtsWireReader(const void *buf, uint32_t length):pos((const unsigned char*)buf),end(pos + length),failed(false) {}
+
+    bool next(HtsWireField &field);
+    bool isValid() const { return !failed; }
+
+    private:
+    const unsigned char *pos;
+    const unsigned char *end;
+    bool failed;
+};
 
-    virtual uint32_t getU32() { return (uint32_t)data; }
-    virtual int64_t getS64() { return data; }
+/* Fixed size node of a parsed message. All nodes of a message live in one
+ * array, the children of every container are stored next to each other so
+ * that walking a map or a list touches contiguous memory. Integers are
+ * decoded into the node, strings and binaries refer to the receive buffer.
+ * Offsets are relative to the start of the receive buffer, 'key' is the
+ * HTS_KEY_* id of the name. */
+struct HtsNode
+{
+    unsigned char type;
+    unsigned char nameLength;
+    uint16_t key;
+    uint32_t name;
+    union
+    {
+        int64_t s64;
+        struct
+        {
+            uint32_t data;
+            uint32_t length;
+        } span;
+        struct
+        {
+            uint32_t first;
+            uint32_t count;
+        } children;
+    };
+};
+
+/* Number of nodes kept inside the index itself. That covers muxpkt and the
+ * other frequent messages, which have around ten fields. */
+#define HTS_INLINE_NODES 32
+
+/* Node array with room for the first HTS_INLINE_NODES nodes built in. Only
+ * bigger messages move it to the arena, so most messages get by without
+ * any allocation for their nodes. */
+class HtsNodeTable
+{
+    public:
+    HtsNodeTable(HtsArena *arena):arena(arena),nodes(inlineNodes),count(0),capacity(HTS_INLINE_NODES) {}
 
-    virtual uint32_t calcSize();
-    virtual void Serialize(void *buf);
+    void push_back(const HtsNode &node)
+    {
+        if(count == capacity)
+            grow();
+        nodes[count++] = node;
+    }
 
-    virtual bool isInt() { return true; }
-    virtual bool isValid() { return true; }
-    virtual unsigned char getType() { return 2; }
+    HtsNode &operator[](uint32_t n) { return nodes[n]; }
+    const HtsNode &operator[](uint32_t n) const { return nodes[n]; }
+    uint32_t size() const { return count; }
 
     private:
-    uint32_t pCalcSize();
-    int64_t data;
+    HtsNodeTable(const HtsNodeTable &);
+    HtsNodeTable &operator=(const HtsNodeTable &);
+
+    void grow();
+
+    HtsArena *arena;
+    HtsNode *nodes;
+    uint32_t count;
+    uint32_t capacity;
+    HtsNode inlineNodes[HTS_INLINE_NODES];
 };
 
-class HtsStr : public HtsData
+class HtsIndex
 {
     public:
-    HtsStr() {}
-    HtsStr(uint32_t length, void *buf);
-    HtsStr(const std::string &str):data(str) {}
+    HtsIndex(HtsArena *arena):arena(arena),nodes(arena) {}
 
-    virtual const std::string &getStr() { return data; }
+    static std::shared_ptr<HtsIndex> Build(uint32_t length, HtsBuffer buf, HtsArena *arena);
 
-    virtual uint32_t calcSize();
-    virtual void Serialize(void *buf);
+    const HtsNode &getNode(uint32_t n) const { return nodes[n]; }
+    const unsigned char *getBase() const { return base; }
 
-    virtual bool isStr() { return true; }
-    virtual bool isValid() { return true; }
-    virtual unsigned char getType() { return 3; }
+    const HtsBuffer &getBuffer() const { return buffer; }
+    HtsArena *getArena() const { return arena; }
 
     private:
-    std::string data;
+    HtsBuffer buffer;
+    const unsigned char *base;
+    HtsArena *arena;
+    HtsNodeTable nodes;
 };
 
-class HtsBin : public HtsData
+/* Handle to a node of a parsed message. Handles are plain values, they stay
+ * valid as long as the message they were taken from. */
+class HtsData
 {
     public:
-    HtsBin(const HtsBin &other);
-    HtsBin():data_length(0),data_buf(0) {}
-    HtsBin(uint32_t length, void *buf);
-    ~HtsBin();
+    HtsData():index(0),node(0) {}
+    HtsData(const HtsIndex *index, uint32_t node):index(index),node(node) {}
+
+    uint32_t getU32() const { return (uint32_t)getS64(); }
+    int64_t getS64() const;
+    std::string getStr() const { return getStrView().str(); }
+    HtsStrView getStrView() const;
+    void getBin(uint32_t *len, void **buf) const;
+    void getBinView(uint32_t *len, const void **buf) const;
+
+    bool isMap() const { return getType() == 1; }
+    bool isList() const { return getType() == 5; }
+    bool isInt() const { return getType() == 2; }
+    bool isStr() const { return getType() == 3; }
+    bool isBin() const { return getType() == 4; }
+    unsigned char getType() const { return index ? index->getNode(node).type : 0; }
+
+    bool isValid() const { return index != 0; }
 
-    virtual void getBin(uint32_t *len, void **buf) const;
-    virtual void setBin(uint32_t len, void *buf);
+    std::string getName() const;
 
-    virtual uint32_t calcSize();
-    virtual void Serialize(void *buf);
+    protected:
+    const HtsNode &getNode() const { return index->getNode(node); }
 
-    virtual bool isBin() { return true; }
-    virtual bool isValid() { return true; }
-    virtual unsigned char getType() { return 4; }
+    const HtsIndex *index;
+    uint32_t node;
+};
+
+class HtsList : public HtsData
+{
+    public:
+    HtsList() {}
+    explicit HtsList(const HtsData &data);
+
+    uint32_t count() const;
+    HtsData getData(uint32_t n) const;
+};
+
+class HtsMap : public HtsData
+{
+    public:
+    HtsMap() {}
+    explicit HtsMap(const HtsData &data);
+
+    bool contains(const std::string &name) const;
+    bool contains(const HtsKey &key) const;
+	using HtsData::getU32;
+    uint32_t getU32(const std::string &name) const;
+    uint32_t getU32(const HtsKey &key) const;
+	using HtsData::getS64;
+    int64_t getS64(const std::string &name) const;
+    int64_t getS64(const HtsKey &key) const;
+	using HtsData::getStr;
+    std::string getStr(const std::string &name) const;
+    std::string getStr(const HtsKey &key) const;
+	using HtsData::getStrView;
+    HtsStrView getStrView(const std::string &name) const;
+    HtsStrView getStrView(const HtsKey &key) const;
+	using HtsData::getBin;
+    void getBin(const std::string &name, uint32_t *len, void **buf) const;
+    void getBin(const HtsKey &key, uint32_t *len, void **buf) const;
+	using HtsData::getBinView;
+    void getBinView(const std::string &name, uint32_t *len, const void **buf) const;
+    void getBinView(const HtsKey &key, uint32_t *len, const void **buf) const;
+    HtsList getList(const std::string &name) const;
+    HtsList getList(const HtsKey &key) const;
+    HtsMap getMap(const std::string &name) const;
+    HtsMap getMap(const HtsKey &key) const;
+
+    HtsData getData(const std::string &name) const;
+    HtsData getData(const HtsKey &key) const;
 
     private:
-    uint32_t data_length;
-    void *data_buf;
+    uint32_t findNode(const std::string &name) const;
+    uint32_t findNode(const HtsKey &key) const;
 };
 
+/* A parsed message. Messages can only be moved, so handing one from the
+ * socket to the demuxer never touches the reference counts. */
 class HtsMessage
 {
     public:
-    HtsMessage():valid(false) {}
+    HtsMessage():valid(false),data(0),length(0),arena(0) {}
+    HtsMessage(HtsMessage &&other);
+    HtsMessage &operator=(HtsMessage &&other);
 
     static HtsMessage Deserialize(uint32_t length, void *buf);
-    bool Serialize(uint32_t *length, void **buf);
+    static HtsMessage Deserialize(uint32_t length, HtsBuffer owner, HtsArena *arena = 0);
+
+    /* Takes the frame without indexing it. Messages with a typed decoder
+     * (see htsschema.h) are read straight from getData(), the node table
+     * is only built on the first call to getRoot(). */
+    static HtsMessage Wrap(uint32_t length, HtsBuffer owner, HtsArena *arena = 0);
 
-    std::shared_ptr<HtsMap> getRoot() { return root; }
-    void setRoot(std::shared_ptr<HtsMap> newRoot) { root = newRoot; valid = true; }
+    HtsMap *getRoot();
+    const HtsBuffer &getBuffer() const;
+    const void *getData() const { return data; }
+    uint32_t getLength() const { return length; }
     bool isValid() { return valid; }
 
     private:
+    HtsMessage(const HtsMessage &);
+    HtsMessage &operator=(const HtsMessage &);
+
     bool valid;
-    std::shared_ptr<HtsMap> root;
+    HtsMap root;
+    std::shared_ptr<HtsIndex> index;
+
+    // Frame not indexed yet
+    const void *data;
+    uint32_t length;
+    HtsBuffer buffer;
+    HtsArena *arena;
+};
+
+/* Incremental parser for replies that carry one very large list, like the
+ * events of getEvents. The frame is fed in pieces as it comes off the socket;
+ * the maps in the top level list named 'list' are decoded one by one and
+ * handed to the callback, then dropped. Everything else ends up in the
+ * message returned by finish(), with that list left empty. Only one element
+ * is held in memory at any time. */
+class HtsStreamParser
+{
+    public:
+    typedef std::function<void(HtsMap &element)> Callback;
+
+    HtsStreamParser(const HtsKey &list, const Callback &callback, HtsArenaPool *pool = 0);
+
+    /* Whether a frame starting with this field header and name is one
+     * for this parser, that is it starts with the list */
+    bool matches(const void *header, uint32_t length) const;
+
+    void begin(uint32_t length);
+    bool feed(const void *data, uint32_t length);
+    HtsMessage finish();
+
+    uint32_t getElements() const { return elements; }
+
+    private:
+    enum
+    {
+        STATE_HEADER,
+        STATE_DATA,
+        STATE_SKIP
+    };
+
+    void onHeader();
+    void endData();
+    void endField();
+
+    HtsKey list;
+    Callback callback;
+    HtsArenaPool *pool;
+
+    int state;
+    bool failed;
+    bool inList;
+    uint32_t frameLeft;
+    uint32_t listLeft;
+    uint32_t dataLeft;
+    uint32_t elements;
+
+    /* Header and name of the field being read */
+    std::vector<unsigned char> pending;
+    uint32_t pendingNeed;
+
+    /* Top level fields that are kept, and the element being read */
+    std::vector<unsigned char> top;
+    HtsBuffer element;
+    HtsArena *elementArena;
+    uint32_t elementLength;
 };
 
 #endif
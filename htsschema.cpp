@@ -0,0 +1,103 @@
+/*****************************************************************************
+ * Copyright (C) 2012
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+
+#include "htsschema.h"
+
+static bool DecodeField(const HtsWireField &field, int64_t &out)
+{
+    if(field.type != 2)
+        return false;
+    out = field.getS64();
+    return true;
+}
+
+static bool DecodeField(const HtsWireField &field, HtsStrView &out)
+{
+    if(field.type != 3)
+        return false;
+    out = HtsStrView((const char*)field.data, field.length);
+    return true;
+}
+
+static bool DecodeField(const HtsWireField &field, HtsBinView &out)
+{
+    if(field.type != 4)
+        return false;
+    out = HtsBinView(field.data, field.length);
+    return true;
+}
+
+template<class T>
+static bool DecodeField(const HtsWireField &field, T &out)
+{
+    if(field.type != 1)
+        return false;
+    return out.decode(field.data, field.length);
+}
+
+// Elements that are not maps are kept as empty entries, so positions in
+// the vector match positions in the list
+template<class T>
+static bool DecodeField(const HtsWireField &field, std::vector<T> &out)
+{
+    if(field.type != 5)
+        return false;
+
+    HtsWireReader reader(field.data, field.length);
+    HtsWireField element;
+    while(reader.next(element))
+    {
+        out.push_back(T());
+        if(element.type == 1)
+            out.back().decode(element.data, element.length);
+    }
+    return reader.isValid();
+}
+
+#define HTS_SCHEMA_FIELD_CASE(type, name) \
+        case HTS_KEY_##name: \
+            if(DecodeField(field, name)) \
+                present |= 1u << FIELD_##name; \
+            break;
+
+#define HTS_DEFINE_SCHEMA(Name, FIELDS) \
+bool Name::decode(const void *buf, uint32_t length) \
+{ \
+    HtsWireReader reader(buf, length); \
+    HtsWireField field; \
+    while(reader.next(field)) \
+    { \
+        switch(field.key) \
+        { \
+        FIELDS(HTS_SCHEMA_FIELD_CASE) \
+        default: \
+            break; \
+        } \
+    } \
+    return reader.isValid(); \
+}
+
+HTS_DEFINE_SCHEMA(HtsSourceInfo, HTS_SCHEMA_SOURCEINFO)
+HTS_DEFINE_SCHEMA(HtsStreamInfo, HTS_SCHEMA_STREAMINFO)
+
+HTS_DEFINE_SCHEMA(HtsMessageHeader, HTS_SCHEMA_HEADER)
+HTS_DEFINE_SCHEMA(HtsMuxPacket, HTS_SCHEMA_MUXPKT)
+HTS_DEFINE_SCHEMA(HtsQueueStatus, HTS_SCHEMA_QUEUESTATUS)
+HTS_DEFINE_SCHEMA(HtsTimeshiftStatus, HTS_SCHEMA_TIMESHIFTSTATUS)
+HTS_DEFINE_SCHEMA(HtsSubscriptionStart, HTS_SCHEMA_SUBSCRIPTIONSTART)
@@ -0,0 +1,121 @@
+/*****************************************************************************
+ * Copyright (C) 2012
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+
+#ifndef H__HTSSCHEMA_H__
+#define H__HTSSCHEMA_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "htsmessage.h"
+
+/* Schemas of the messages that arrive for every packet or every few seconds.
+ * Each one becomes a plain struct with a member and a presence bit per field,
+ * filled by decode() in a single pass over the wire bytes without building
+ * the node table. A field that is missing or has an unexpected type keeps
+ * its default value and its bit stays clear. Everything else still goes
+ * through HtsMessage::getRoot(). */
+
+#define HTS_SCHEMA_HEADER(X) \
+    X(HtsStrView, method) \
+    X(int64_t, subscriptionId) \
+    X(int64_t, seq)
+
+#define HTS_SCHEMA_MUXPKT(X) \
+    X(int64_t, subscriptionId) \
+    X(int64_t, stream) \
+    X(int64_t, frametype) \
+    X(int64_t, pts) \
+    X(int64_t, dts) \
+    X(int64_t, duration) \
+    X(HtsBinView, payload)
+
+#define HTS_SCHEMA_QUEUESTATUS(X) \
+    X(int64_t, subscriptionId) \
+    X(int64_t, packets) \
+    X(int64_t, bytes) \
+    X(int64_t, delay) \
+    X(int64_t, Bdrops) \
+    X(int64_t, Pdrops) \
+    X(int64_t, Idrops)
+
+#define HTS_SCHEMA_TIMESHIFTSTATUS(X) \
+    X(int64_t, subscriptionId) \
+    X(int64_t, shift) \
+    X(int64_t, start) \
+    X(int64_t, end)
+
+#define HTS_SCHEMA_SOURCEINFO(X) \
+    X(HtsStrView, service)
+
+#define HTS_SCHEMA_STREAMINFO(X) \
+    X(int64_t, index) \
+    X(HtsStrView, type) \
+    X(HtsStrView, language) \
+    X(int64_t, width) \
+    X(int64_t, height) \
+    X(int64_t, channels) \
+    X(int64_t, rate) \
+    X(HtsBinView, meta)
+
+#define HTS_SCHEMA_FIELD_ID(type, name) FIELD_##name,
+#define HTS_SCHEMA_FIELD_INIT(type, name) ,name()
+#define HTS_SCHEMA_FIELD_MEMBER(type, name) type name;
+
+#define HTS_DECLARE_SCHEMA(Name, FIELDS) \
+struct Name \
+{ \
+    enum { FIELDS(HTS_SCHEMA_FIELD_ID) FIELD_COUNT }; \
+    static_assert(FIELD_COUNT <= 32, "too many fields in " #Name); \
+\
+    Name():present(0) FIELDS(HTS_SCHEMA_FIELD_INIT) {} \
+\
+    bool decode(const void *buf, uint32_t length); \
+    bool has(int field) const { return (present & (1u << field)) != 0; } \
+\
+    uint32_t present; \
+    FIELDS(HTS_SCHEMA_FIELD_MEMBER) \
+};
+
+HTS_DECLARE_SCHEMA(HtsMessageHeader, HTS_SCHEMA_HEADER)
+HTS_DECLARE_SCHEMA(HtsMuxPacket, HTS_SCHEMA_MUXPKT)
+HTS_DECLARE_SCHEMA(HtsQueueStatus, HTS_SCHEMA_QUEUESTATUS)
+HTS_DECLARE_SCHEMA(HtsTimeshiftStatus, HTS_SCHEMA_TIMESHIFTSTATUS)
+HTS_DECLARE_SCHEMA(HtsSourceInfo, HTS_SCHEMA_SOURCEINFO)
+HTS_DECLARE_SCHEMA(HtsStreamInfo, HTS_SCHEMA_STREAMINFO)
+
+#define HTS_SCHEMA_SUBSCRIPTIONSTART(X) \
+    X(int64_t, subscriptionId) \
+    X(HtsSourceInfo, sourceinfo) \
+    X(std::vector<HtsStreamInfo>, streams)
+
+HTS_DECLARE_SCHEMA(HtsSubscriptionStart, HTS_SCHEMA_SUBSCRIPTIONSTART)
+
+/* Decodes a message that came off the socket. Any message decodes, the
+ * fields the schema doesn't know are skipped and the ones it misses keep
+ * their bit clear. Messages put together by HtsStreamParser decode from
+ * their top level, without the list that was streamed. Returns false only
+ * for a malformed frame. */
+template<class T>
+bool HtsDecode(HtsMessage &msg, T &out)
+{
+    return out.decode(msg.getData(), msg.getLength());
+}
+
+#endif
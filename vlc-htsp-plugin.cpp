@@ -36,11 +36,18 @@ vlc_module_begin ()
     set_category( CAT_INPUT )
     set_subcategory( SUBCAT_INPUT_ACCESS )
     set_callbacks( OpenHTSP, CloseHTSP )
+    set_section("Connection", NULL)
+    add_bool( CFG_PREFIX"fast-open", false, "Fast Channel Open", "Send hello, authenticate and subscribe without waiting for each reply and load the EPG in the background. Errors are then reported after playback has started.", false )
+    add_integer_with_range( CFG_PREFIX"queue-size", 16384, QUEUE_SIZE_MIN, QUEUE_SIZE_MAX, "Queue Size", "Maximum amount of data (in KiB) held for the demuxer. Once reached, reading from the server pauses until the demuxer caught up.", false )
+    add_integer_with_range( CFG_PREFIX"queue-messages", 4096, QUEUE_MESSAGES_MIN, QUEUE_MESSAGES_MAX, "Queue Messages", "Maximum number of messages held for the demuxer.", false )
+    add_integer_with_range( CFG_PREFIX"demux-batch", 32, 1, DEMUX_BATCH_MAX, "Demux Batch Size", "Maximum number of messages demuxed at once. 1 handles every message on its own.", false )
+    add_integer_with_range( CFG_PREFIX"demux-batch-time", 5000, 0, DEMUX_BATCH_TIME_MAX, "Demux Batch Time", "Maximum time (in microseconds) spent demuxing at once. 0 sets no limit besides the batch size.", false )
+    add_integer_with_range( CFG_PREFIX"pcr-interval", 100000, 0, PCR_INTERVAL_MAX, "PCR Interval", "Minimum stream time (in microseconds) between clock references. Lower values let VLC buffer less, 0 sends one whenever the clock moves.", false )
     set_section("Profile", NULL)
     add_bool( CFG_PREFIX"useprofile", false, "Use Profile", "Enable use of streaming profile, fill \"Stream Profile\" with profile name.", false )
     add_string( CFG_PREFIX"profile", "pass", "Stream Profile", "Select stream profile (Added in version 16).", false )
     set_section("Audio", NULL)
-    add_bool( CFG_PREFIX"audio-only", false, "Audio Only", "Discards all video streams, if the server supports it.", false )
+    add_bool( CFG_PREFIX"audio-only", false, "Audio Only", "Discards all video streams, if the server supports it. Streams with an index of 256 or more are only discarded by the server.", false )
     set_section("Transcoding", NULL)
     add_bool( CFG_PREFIX"transcode", false, "Enable Transcoding", "Enabled stream transcoding.", false )
     add_string( CFG_PREFIX"vcodec", "", "Video Codec", "Transcode target video codec", false )